@@ -0,0 +1,698 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "piecetable.h"
+#include "newline.h"
+#include "utf8.h"
+#include "gapbuffer.h"
+
+// Benchmarks for the piece table
+// Run all of them with `./bench`, or some of them with `./bench name...`
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} Benchmark;
+
+// Lines of the editor
+typedef struct {
+  GapBuffer **elems;
+  size_t size;
+  size_t capacity;
+} Lines;
+
+/* Returns the time in seconds from an arbitrary point. */
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns length random lowercase chars with a newline every so often. */
+char *randomText(size_t length) {
+  char *text = malloc(length);
+  for (size_t i = 0; i < length; i++) {
+    text[i] = rand() % 64 == 0 ? '\n' : 'a' + rand() % 26;
+  }
+  return text;
+}
+
+/* Breaks a piece table into many pieces with single char inserts spread
+ * over the whole text. */
+void fragment(PieceTable *pt, int edits) {
+  for (int i = 0; i < edits; i++) {
+    ptInsertChar(pt, rand() % (pt->sequence_length + 1), 'a' + rand() % 26);
+  }
+}
+
+/* Types into a fragmented table, with the odd backspace and a read of the
+ * text around the cursor, with and without the seek hint. */
+void benchSeekHint(void) {
+  const size_t text_length = 4 * 1024 * 1024;
+  const int edits = 200000;
+  const int keystrokes = 1000000;
+  char *text = randomText(text_length);
+
+  for (int hint = 0; hint <= 1; hint++) {
+    srand(1);
+    PieceTable *pt = ptCreate(text, text_length);
+    fragment(pt, edits);
+    pt->seek_hint = hint;
+
+    char line[80];
+    size_t pos = pt->sequence_length / 2;
+    double start = now();
+    for (int i = 0; i < keystrokes; i++) {
+      if (i % 16 == 15) {
+        ptDeleteChar(pt, --pos);
+        ptGetChars(pt, line, pos - 40, sizeof(line));
+      } else {
+        ptInsertChar(pt, pos++, 'a' + i % 26);
+      }
+    }
+    double elapsed = now() - start;
+    printf("  %-12s %8.1f ns/keystroke\n", hint ? "with hint" : "without hint", elapsed * 1e9 / keystrokes);
+    ptFree(pt);
+  }
+  free(text);
+}
+
+typedef struct {
+  const char *text;
+  size_t text_length;
+  int edits;
+  unsigned seed;
+} EditJob;
+
+/* Types in bursts at random places of a table of its own. */
+void *editTable(void *arg) {
+  EditJob *job = arg;
+  PieceTable *pt = ptCreate(job->text, job->text_length);
+  size_t pos = 0;
+  for (int i = 0; i < job->edits; i++) {
+    if (i % 64 == 0) pos = rand_r(&job->seed) % (pt->sequence_length + 1);
+    if (i % 16 == 15 && pos > 0) {
+      ptDeleteChar(pt, --pos);
+    } else {
+      ptInsertChar(pt, pos++, 'a' + i % 26);
+    }
+  }
+  ptFree(pt);
+  return NULL;
+}
+
+/* Edits one table per thread, for 1 up to as many threads as cores. */
+void benchThreads(void) {
+  const size_t text_length = 1024 * 1024;
+  const int edits = 500000;
+  char *text = randomText(text_length);
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *threads = malloc(cores * sizeof(pthread_t));
+  EditJob *jobs = malloc(cores * sizeof(EditJob));
+
+  double base = 0;
+  for (long n = 1; n <= cores; n = n < cores && n * 2 > cores ? cores : n * 2) {
+    double start = now();
+    for (long i = 0; i < n; i++) {
+      jobs[i] = (EditJob) { text, text_length, edits, i + 1 };
+      pthread_create(&threads[i], NULL, editTable, &jobs[i]);
+    }
+    for (long i = 0; i < n; i++) pthread_join(threads[i], NULL);
+    double rate = n * edits / (now() - start);
+    if (n == 1) base = rate;
+    printf("  %3ld threads %8.2f M edits/s %6.2fx\n", n, rate / 1e6, rate / base);
+  }
+  free(threads);
+  free(jobs);
+  free(text);
+}
+
+/* Applies a batch of small replacements spread over a fragmented table,
+ * one call per edit against a single ptApplyEdits. */
+void benchApplyEdits(void) {
+  const size_t text_length = 4 * 1024 * 1024;
+  const int n = 50000;
+  char *text = randomText(text_length);
+
+  // edits at evenly spaced offsets, so none overlap
+  PtEdit *edits = malloc(n * sizeof(PtEdit));
+  for (int i = 0; i < n; i++) {
+    edits[i] = (PtEdit) { (text_length / n) * i + rand() % 8, 3, "abcd", 4 };
+  }
+
+  for (int batch = 0; batch <= 1; batch++) {
+    srand(1);
+    PieceTable *pt = ptCreate(text, text_length);
+    fragment(pt, 100000);
+    // keep the offsets valid for the fragmented text
+    for (int i = 0; i < n; i++) edits[i].offset = (pt->sequence_length / n) * i + i % 8;
+
+    double start = now();
+    if (batch) {
+      ptApplyEdits(pt, edits, n);
+    } else {
+      // back to front, so the offsets of the remaining edits stay valid
+      for (int i = n - 1; i >= 0; i--) {
+        ptDeleteChars(pt, edits[i].offset, edits[i].delete_length);
+        ptInsertChars(pt, edits[i].offset, edits[i].chars, edits[i].length);
+      }
+    }
+    double elapsed = now() - start;
+    // undo the whole batch, which is two records per edit one call at a time
+    start = now();
+    for (int i = 0; i < (batch ? 1 : 2 * n); i++) ptUndo(pt);
+    double undo_elapsed = now() - start;
+    printf("  %-12s %8.1f ms, undo %8.1f ms\n", batch ? "ptApplyEdits" : "per call", elapsed * 1e3, undo_elapsed * 1e3);
+    ptFree(pt);
+  }
+  free(edits);
+  free(text);
+}
+
+/* Sums the text of a table, standing in for saving or hashing it. */
+unsigned long checksum(PieceTable *pt) {
+  unsigned long sum = 0;
+  PieceIterator it = ptIterBegin(pt, 0);
+  Span span;
+  while (ptIterNext(&it, &span)) {
+    for (size_t i = 0; i < span.length; i++) sum = sum * 31 + span.chars[i];
+  }
+  return sum;
+}
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  PieceTable *snapshot; // waiting to be saved
+  bool done;
+  int saves;
+} Saver;
+
+/* Saves the snapshots handed to it until told to stop. */
+void *saveSnapshots(void *arg) {
+  Saver *saver = arg;
+  pthread_mutex_lock(&saver->lock);
+  while (true) {
+    while (saver->snapshot == NULL && !saver->done) pthread_cond_wait(&saver->ready, &saver->lock);
+    if (saver->snapshot == NULL) break;
+    PieceTable *snapshot = saver->snapshot;
+    saver->snapshot = NULL;
+    pthread_mutex_unlock(&saver->lock);
+    checksum(snapshot);
+    ptRelease(snapshot);
+    pthread_mutex_lock(&saver->lock);
+    saver->saves++;
+  }
+  pthread_mutex_unlock(&saver->lock);
+  return NULL;
+}
+
+/* Types into a large fragmented table with an autosave every so many
+ * keystrokes, either in line or of a snapshot on another thread, and
+ * reports the slowest keystroke. */
+void benchSnapshot(void) {
+  const size_t text_length = 64 * 1024 * 1024;
+  const int keystrokes = 200000;
+  const int autosave = 20000;
+  char *text = randomText(text_length);
+
+  for (int background = 0; background <= 1; background++) {
+    srand(1);
+    PieceTable *pt = ptCreate(text, text_length);
+    fragment(pt, 100000);
+    Saver saver = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, false, 0 };
+    pthread_t thread;
+    if (background) pthread_create(&thread, NULL, saveSnapshots, &saver);
+
+    size_t pos = pt->sequence_length / 2;
+    double worst = 0, snapshot_time = 0;
+    double start = now();
+    for (int i = 0; i < keystrokes; i++) {
+      double keystroke = now();
+      if (i % 64 == 0) pos = rand() % (pt->sequence_length + 1);
+      ptInsertChar(pt, pos++, 'a' + i % 26);
+      if (i % autosave == autosave - 1) {
+        if (background) {
+          double snapshot_start = now();
+          pthread_mutex_lock(&saver.lock);
+          if (saver.snapshot == NULL) {
+            saver.snapshot = ptSnapshot(pt);
+            pthread_cond_signal(&saver.ready);
+          }
+          pthread_mutex_unlock(&saver.lock);
+          snapshot_time += now() - snapshot_start;
+        } else {
+          checksum(pt);
+        }
+      }
+      double elapsed = now() - keystroke;
+      if (elapsed > worst) worst = elapsed;
+    }
+    double elapsed = now() - start;
+
+    if (background) {
+      pthread_mutex_lock(&saver.lock);
+      saver.done = true;
+      pthread_cond_signal(&saver.ready);
+      pthread_mutex_unlock(&saver.lock);
+      pthread_join(thread, NULL);
+      printf("  %-12s %8.1f ns/keystroke, slowest %8.3f ms, %d saves, %.1f us/snapshot\n", "snapshot",
+             elapsed * 1e9 / keystrokes, worst * 1e3, saver.saves, snapshot_time * 1e6 / (keystrokes / autosave));
+    } else {
+      printf("  %-12s %8.1f ns/keystroke, slowest %8.3f ms\n", "in line", elapsed * 1e9 / keystrokes, worst * 1e3);
+    }
+    ptFree(pt);
+  }
+  free(text);
+}
+
+/* Reopens a large edited file from a session, against creating a table
+ * over the file again, which loses the edits and history. */
+void benchSession(void) {
+  const size_t text_length = 256 * 1024 * 1024;
+  const char file_name[] = "/tmp/olik-bench.txt";
+  const char session_name[] = "/tmp/olik-bench.session";
+  char *text = randomText(text_length);
+  FILE *fp = fopen(file_name, "w");
+  fwrite(text, 1, text_length, fp);
+  fclose(fp);
+  free(text);
+
+  srand(1);
+  PieceTable *pt = ptCreateFromFile(file_name);
+  fragment(pt, 200000);
+  double start = now();
+  ptSaveSession(pt, session_name, file_name);
+  printf("  %-12s %8.1f ms\n", "save", (now() - start) * 1e3);
+  ptFree(pt);
+
+  start = now();
+  pt = ptCreateFromFile(file_name);
+  printf("  %-12s %8.1f ms\n", "from file", (now() - start) * 1e3);
+  ptFree(pt);
+  start = now();
+  pt = ptLoadSession(session_name);
+  printf("  %-12s %8.1f ms, %zu undo records\n", "session", (now() - start) * 1e3, pt->undo_stack.size);
+  ptFree(pt);
+  remove(session_name);
+  remove(file_name);
+}
+
+/* Saves a large fragmented document with ptWriteToFile, against the
+ * editor's save path of one gap buffer per line written with gbPrint. */
+void benchSave(void) {
+  const size_t text_length = 256 * 1024 * 1024;
+  const char file_name[] = "/tmp/olik-bench.txt";
+  char *text = randomText(text_length);
+
+  srand(1);
+  PieceTable *pt = ptCreate(text, text_length);
+  fragment(pt, 100000);
+  double start = now();
+  ptWriteToFile(pt, file_name, false);
+  double elapsed = now() - start;
+  printf("  %-12s %8.1f ms, %6.0f MB/s\n", "ptWriteToFile", elapsed * 1e3, text_length / elapsed / 1e6);
+  start = now();
+  ptWriteToFile(pt, file_name, true);
+  elapsed = now() - start;
+  printf("  %-12s %8.1f ms, %6.0f MB/s\n", "  with fsync", elapsed * 1e3, text_length / elapsed / 1e6);
+  ptFree(pt);
+
+  Lines lines = {0};
+  for (char *line = text, *end = text + text_length; line < end;) {
+    char *newline = memchr(line, '\n', end - line);
+    if (newline == NULL) newline = end;
+    GapBuffer *gb = gbCreate();
+    gbPushChars(gb, line, newline - line);
+    listAppend(&lines, gb);
+    line = newline + 1;
+  }
+  start = now();
+  FILE *fp = fopen(file_name, "w");
+  for (size_t i = 0; i < lines.size; i++) {
+    gbPrint(lines.elems[i], fp);
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  elapsed = now() - start;
+  printf("  %-12s %8.1f ms, %6.0f MB/s\n", "gbPrint", elapsed * 1e3, text_length / elapsed / 1e6);
+
+  for (size_t i = 0; i < lines.size; i++) gbFree(lines.elems[i]);
+  free(lines.elems);
+  remove(file_name);
+  free(text);
+}
+
+/* Searches a large fragmented table for needles that are not in it, so
+ * that the whole text is scanned, in both directions. */
+void benchSearch(void) {
+  const size_t text_length = 256 * 1024 * 1024;
+  const char *needles[] = { "#", "q#", "qu#x", "quick brown fox#", "the quick brown fox jumps over the lazy dog, twice#" };
+  char *text = randomText(text_length);
+
+  srand(1);
+  PieceTable *pt = ptCreate(text, text_length);
+  fragment(pt, 100000);
+  for (size_t i = 0; i < sizeof(needles) / sizeof(*needles); i++) {
+    size_t length = strlen(needles[i]);
+    double start = now();
+    size_t found = ptSearchForward(pt, 0, needles[i], length);
+    double forward_elapsed = now() - start;
+    start = now();
+    found &= ptSearchBackward(pt, pt->sequence_length, needles[i], length);
+    double backward_elapsed = now() - start;
+    if (found != PT_NOT_FOUND) printf("  found %s\n", needles[i]);
+    printf("  length %-3zu forward %6.2f GB/s, backward %6.2f GB/s\n", length,
+           pt->sequence_length / forward_elapsed / 1e9, pt->sequence_length / backward_elapsed / 1e9);
+  }
+  ptFree(pt);
+  free(text);
+}
+
+/* Searches a snapshot of a large fragmented table for every match of a
+ * rare needle with more and more threads. */
+void benchParallelSearch(void) {
+  const size_t text_length = 512 * 1024 * 1024;
+  const char needle[] = "zzzz";
+  char *text = randomText(text_length);
+
+  srand(1);
+  PieceTable *pt = ptCreate(text, text_length);
+  fragment(pt, 100000);
+  PieceTable *snapshot = ptSnapshot(pt);
+  printf("  %ld cpus\n", sysconf(_SC_NPROCESSORS_ONLN));
+  double single = 0;
+  for (unsigned threads = 1; threads <= 16; threads *= 2) {
+    Offsets matches = {0};
+    double start = now();
+    ptSearchAll(snapshot, needle, sizeof(needle) - 1, threads, NULL, &matches);
+    double elapsed = now() - start;
+    if (threads == 1) single = elapsed;
+    printf("  %2u threads %8.1f ms, %6.2f GB/s, %4.2fx, %zu matches\n", threads, elapsed * 1e3,
+           text_length / elapsed / 1e9, single / elapsed, matches.size);
+    free(matches.elems);
+  }
+  ptRelease(snapshot);
+  ptFree(pt);
+  free(text);
+}
+
+/* Counts the codepoints of a large text with each version of the kernel,
+ * then converts between offsets and columns in a fragmented table of it. */
+void benchUtf8(void) {
+  const size_t text_length = 64 * 1024 * 1024;
+  const int lookups = 1000000;
+  char *text = randomText(text_length);
+  // sprinkle in two and three byte chars
+  for (size_t i = 0; i + 3 < text_length; i += 61) {
+    memcpy(&text[i], i % 2 ? "\xc3\xa9" : "\xe4\xb8\x96", i % 2 ? 2 : 3);
+  }
+  struct {
+    const char *name;
+    size_t (*count)(const char *, size_t);
+  } kernels[] = {
+    { "scalar", utf8CountScalar },
+#ifdef UTF8_X86
+    { "sse2", utf8CountSse2 },
+    { "avx2", utf8CountAvx2 },
+#endif
+  };
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+    double start = now();
+    size_t count = kernels[i].count(text, text_length);
+    double elapsed = now() - start;
+    printf("  %-8s count %6.2f GB/s (%zu codepoints)\n", kernels[i].name, text_length / elapsed / 1e9, count);
+  }
+  double start = now();
+  size_t width = utf8Width(text, text_length, 0);
+  double elapsed = now() - start;
+  printf("  %-8s width %6.2f GB/s (%zu columns)\n", "", text_length / elapsed / 1e9, width);
+
+  srand(1);
+  PieceTable *pt = ptCreate(text, text_length);
+  fragment(pt, 100000);
+  size_t lines = ptLineCount(pt), sum = 0;
+  start = now();
+  for (int i = 0; i < lookups; i++) sum += ptOffsetToColumn(pt, rand() % pt->sequence_length);
+  elapsed = now() - start;
+  printf("  %-22s %6.0f ns\n", "ptOffsetToColumn", elapsed / lookups * 1e9);
+  start = now();
+  for (int i = 0; i < lookups; i++) sum += ptColumnToOffset(pt, rand() % lines, rand() % 80);
+  elapsed = now() - start;
+  printf("  %-22s %6.0f ns\n", "ptColumnToOffset", elapsed / lookups * 1e9);
+  start = now();
+  for (int i = 0; i < lookups; i++) sum += ptCodepointToOffset(pt, rand() % ptCodepointCount(pt));
+  elapsed = now() - start;
+  printf("  %-22s %6.0f ns (%zu)\n", "ptCodepointToOffset", elapsed / lookups * 1e9, sum % 10);
+  ptFree(pt);
+  free(text);
+}
+
+/* Edits a 1MB line in a gap buffer at random positions, and at positions
+ * near the last one like typing and moving the cursor around does. */
+void benchGapBuffer(void) {
+  const size_t line_length = 1024 * 1024;
+  const int edits = 20000;
+  char *text = randomText(line_length);
+
+  for (int near = 0; near <= 1; near++) {
+    srand(1);
+    GapBuffer *gb = gbCreate();
+    gbPushChars(gb, text, line_length);
+    size_t pos = line_length / 2;
+    double start = now();
+    for (int i = 0; i < edits; i++) {
+      size_t len = gbLen(gb);
+      pos = near ? (pos + len + rand() % 33 - 16) % len : rand() % len;
+      gbMoveGap(gb, pos + 1);
+      if (rand() % 4 == 0) {
+        gbDeleteChar(gb);
+      } else {
+        gbInsertChar(gb, 'a' + rand() % 26);
+      }
+    }
+    double elapsed = now() - start;
+    printf("  %-8s %8.0f ns/edit\n", near ? "near" : "random", elapsed / edits * 1e9);
+    gbFree(gb);
+  }
+  free(text);
+}
+
+/* Saves many lines with a gap in the middle to /dev/null through stdio a
+ * line at a time and with writev over their spans. */
+void benchGapBufferSave(void) {
+  const size_t line_count = 200000, line_length = 80;
+  const int rounds = 10;
+  char *text = randomText(line_length);
+  GapBuffer **lines = malloc(line_count * sizeof(GapBuffer *));
+  for (size_t i = 0; i < line_count; i++) {
+    lines[i] = gbCreate();
+    gbPushChars(lines[i], text, line_length);
+    gbMoveGap(lines[i], line_length / 2);
+  }
+
+  FILE *fp = fopen("/dev/null", "w");
+  double start = now();
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < line_count; i++) {
+      gbPrint(lines[i], fp);
+      fputc('\n', fp);
+    }
+    fflush(fp);
+  }
+  double elapsed = now() - start;
+  printf("  %-8s %8.1f ns/line\n", "print", elapsed / rounds / line_count * 1e9);
+  fclose(fp);
+
+  int fd = open("/dev/null", O_WRONLY);
+  start = now();
+  for (int r = 0; r < rounds; r++) gbWriteLines(lines, line_count, fd);
+  elapsed = now() - start;
+  printf("  %-8s %8.1f ns/line\n", "writev", elapsed / rounds / line_count * 1e9);
+  close(fd);
+
+  for (size_t i = 0; i < line_count; i++) gbFree(lines[i]);
+  free(lines);
+  free(text);
+}
+
+/* Returns the resident memory of the process in bytes, 0 if unknown. */
+size_t residentBytes(void) {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) return 0;
+  size_t pages = 0, resident = 0;
+  if (fscanf(fp, "%zu %zu", &pages, &resident) != 2) resident = 0;
+  fclose(fp);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Reads every char of every line the way rendering does. */
+size_t walkLines(GapBuffer **lines, size_t count) {
+  size_t sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    GbSpan spans[2];
+    int n = gbSpans(lines[i], spans);
+    for (int j = 0; j < n; j++) {
+      for (size_t k = 0; k < spans[j].length; k++) sum += (unsigned char) spans[j].chars[k];
+    }
+  }
+  return sum;
+}
+
+/* Loads a file of a million short lines into gap buffers a line at a time
+ * with getline, and with one read sliced into lines that borrow from it,
+ * then walks the lines. */
+void benchGapBufferLoad(void) {
+  const size_t length = 64 * 1024 * 1024;
+  char *text = randomText(length);
+  char path[] = "/tmp/bench-load-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1 || write(fd, text, length) != (ssize_t) length) {
+    printf("  cannot write %s\n", path);
+    free(text);
+    return;
+  }
+  close(fd);
+  free(text);
+
+  size_t resident = residentBytes();
+  double start = now();
+  FILE *fp = fopen(path, "r");
+  GapBuffer **lines = NULL;
+  size_t count = 0, capacity = 0, line_length = 0;
+  char *line = NULL;
+  ssize_t read_length;
+  while ((read_length = getline(&line, &line_length, fp)) != -1) {
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      lines = realloc(lines, capacity * sizeof(GapBuffer *));
+    }
+    lines[count] = gbCreate();
+    gbPushChars(lines[count++], line, read_length - (line[read_length - 1] == '\n'));
+  }
+  fclose(fp);
+  free(line);
+  double elapsed = now() - start;
+  size_t used = residentBytes() - resident;
+  start = now();
+  size_t sum = walkLines(lines, count);
+  printf("  %-8s %zu lines %8.1f ms %8.1f MiB, walk %6.1f ms\n", "getline", count, elapsed * 1e3,
+         used / (1024.0 * 1024.0), (now() - start) * 1e3);
+  for (size_t i = 0; i < count; i++) gbFree(lines[i]);
+  free(lines);
+
+  resident = residentBytes();
+  start = now();
+  fd = open(path, O_RDONLY);
+  text = malloc(length);
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = read(fd, &text[done], length - done);
+    if (n <= 0) break;
+    done += n;
+  }
+  close(fd);
+  GapBuffer *slices = gbSliceLines(text, done, &count);
+  lines = malloc(count * sizeof(GapBuffer *));
+  for (size_t i = 0; i < count; i++) lines[i] = &slices[i];
+  elapsed = now() - start;
+  used = residentBytes() - resident;
+  start = now();
+  if (walkLines(lines, count) != sum) printf("  walks differ\n");
+  printf("  %-8s %zu lines %8.1f ms %8.1f MiB, walk %6.1f ms\n", "slices", count, elapsed * 1e3,
+         used / (1024.0 * 1024.0), (now() - start) * 1e3);
+  free(lines);
+  free(slices);
+  free(text);
+  unlink(path);
+}
+
+/* Counts and finds the newlines of a large text with each version of the
+ * scanners and with a memchr loop. */
+size_t countMemchr(const char *chars, size_t length) {
+  size_t count = 0;
+  const char *end = &chars[length];
+  for (const char *c = chars; (c = memchr(c, '\n', end - c)); c++) count++;
+  return count;
+}
+
+size_t locateMemchr(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned) {
+  size_t count = 0;
+  const char *end = &chars[length];
+  for (const char *c = chars; count < max && (c = memchr(c, '\n', end - c)); c++) {
+    offsets[count++] = base + (size_t) (c - chars);
+  }
+  *scanned = length;
+  return count;
+}
+
+void benchNewlines(void) {
+  const size_t text_length = 256 * 1024 * 1024;
+  char *text = randomText(text_length);
+  struct {
+    const char *name;
+    size_t (*count)(const char *, size_t);
+    size_t (*locate)(const char *, size_t, size_t, size_t *, size_t, size_t *);
+  } scanners[] = {
+    { "memchr", countMemchr, locateMemchr },
+    { "scalar", nlCountScalar, nlLocateScalar },
+#ifdef NL_X86
+    { "sse2", nlCountSse2, nlLocateSse2 },
+    { "avx2", nlCountAvx2, nlLocateAvx2 },
+#endif
+    { "dispatch", nlCount, nlLocate },
+  };
+  size_t newlines = countMemchr(text, text_length);
+  size_t *offsets = malloc(newlines * sizeof(size_t));
+
+  for (size_t i = 0; i < sizeof(scanners) / sizeof(*scanners); i++) {
+    double start = now();
+    size_t count = scanners[i].count(text, text_length);
+    double count_elapsed = now() - start;
+    size_t scanned;
+    start = now();
+    size_t located = scanners[i].locate(text, text_length, 0, offsets, newlines, &scanned);
+    double locate_elapsed = now() - start;
+    if (count != newlines || located != newlines) printf("  %s got the wrong count\n", scanners[i].name);
+    printf("  %-10s count %6.2f GB/s, locate %6.2f GB/s\n", scanners[i].name,
+           text_length / count_elapsed / 1e9, text_length / locate_elapsed / 1e9);
+  }
+  free(offsets);
+  free(text);
+}
+
+Benchmark benchmarks[] = {
+  { "seek-hint", benchSeekHint },
+  { "threads", benchThreads },
+  { "apply-edits", benchApplyEdits },
+  { "snapshot", benchSnapshot },
+  { "session", benchSession },
+  { "save", benchSave },
+  { "newlines", benchNewlines },
+  { "search", benchSearch },
+  { "parallel-search", benchParallelSearch },
+  { "utf8", benchUtf8 },
+  { "gap-buffer", benchGapBuffer },
+  { "gap-buffer-save", benchGapBufferSave },
+  { "gap-buffer-load", benchGapBufferLoad },
+};
+
+int main(int argc, char *argv[]) {
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+    bool selected = argc == 1;
+    for (int j = 1; j < argc; j++) {
+      if (strcmp(argv[j], benchmarks[i].name) == 0) selected = true;
+    }
+    if (!selected) continue;
+    printf("%s\n", benchmarks[i].name);
+    benchmarks[i].run();
+  }
+  return 0;
+}
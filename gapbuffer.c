@@ -1,134 +1,337 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "gapbuffer.h"
+#include "newline.h"
+#include "io.h"
 
 /* Return the length of the gap buffer. */
 size_t gbLen(GapBuffer *buf) {
-  return buf->head.size + buf->tail.size;
+  return buf->gap_start + buf->end - buf->gap_end;
 }
 
-/* Prints the gap buffer as a string to file descriptor. */
+/* Prints the gap buffer to fp straight from its two halves. Returns the
+ * number of chars written. */
 size_t gbPrint(GapBuffer *buf, FILE *fp) {
-  size_t size = gbLen(buf);
-  char chars[size + 1];
-  chars[size] = '\0';
-  if (size < buf->head.size) {
-    // Only need to write chars from head string
-    memcpy(chars, buf->head.elems, size);
+  GbSpan spans[2];
+  int n = gbSpans(buf, spans);
+  size_t written = 0;
+  flockfile(fp);
+  for (int i = 0; i < n; i++) written += fwrite(spans[i].chars, sizeof(char), spans[i].length, fp);
+  funlockfile(fp);
+  return written;
+}
+
+/* Moves the chars after the gap so that they start at tail_start. */
+void gbMoveTail(GapBuffer *buf, size_t tail_start) {
+  size_t tail = buf->end - buf->gap_end;
+  if (tail > 0) memmove(&buf->elems[tail_start], &buf->elems[buf->gap_end], tail * sizeof(char));
+  buf->gap_end = tail_start;
+  buf->end = tail_start + tail;
+}
+
+/* Returns the inline chars of a buffer from gbCreate. */
+char *gbInline(GapBuffer *buf) {
+  return (char *) (buf + 1);
+}
+
+/* Returns whether the chars of buf are in a heap block of its own. */
+bool gbOnHeap(GapBuffer *buf) {
+  return !buf->borrowed && !(buf->has_inline && buf->elems == gbInline(buf));
+}
+
+/* Moves the chars of buf into elems, which has room for capacity chars,
+ * splitting the free room between the gap and the end. Frees the heap
+ * block buf had. */
+void gbRehome(GapBuffer *buf, char *elems, size_t capacity) {
+  size_t tail = buf->end - buf->gap_end;
+  size_t tail_start = buf->gap_start + (capacity - gbLen(buf)) / 2;
+  memcpy(elems, buf->elems, buf->gap_start * sizeof(char));
+  memcpy(&elems[tail_start], &buf->elems[buf->gap_end], tail * sizeof(char));
+  if (gbOnHeap(buf)) free(buf->elems);
+  buf->elems = elems;
+  buf->capacity = capacity;
+  buf->gap_end = tail_start;
+  buf->end = tail_start + tail;
+  buf->borrowed = false;
+}
+
+/* Gives a buffer that borrows its chars a copy of them it can change,
+ * inline if they fit. */
+void gbOwn(GapBuffer *buf) {
+  size_t len = gbLen(buf);
+  if (buf->has_inline && len <= GB_INLINE_CAPACITY) {
+    gbRehome(buf, gbInline(buf), GB_INLINE_CAPACITY);
   } else {
-    memcpy(chars, buf->head.elems, buf->head.size * sizeof(char));
-    memcpy(&chars[buf->head.size], buf->tail.elems, (size - buf->head.size) * sizeof(char));
+    char *elems = malloc((len + GB_MIN_ROOM) * sizeof(char));
+    assert(elems != NULL);
+    gbRehome(buf, elems, len + GB_MIN_ROOM);
+  }
+}
+
+/* Makes room for length chars in the gap, or after the end if at_gap is
+ * false. The free room is split evenly between the gap and the end, and
+ * the buffer doubles when there is not enough of it, so growing is
+ * amortized O(1) per char. A buffer leaves its inline chars for the heap
+ * once they are full, and copies borrowed chars before changing them. */
+void gbReserve(GapBuffer *buf, size_t length, bool at_gap) {
+  if (buf->borrowed) gbOwn(buf);
+  size_t gap = buf->gap_end - buf->gap_start;
+  size_t room = buf->capacity - buf->end;
+  if (at_gap ? gap >= length : room >= length) return;
+
+  size_t len = gbLen(buf);
+  // inline chars are used up before moving to the heap
+  if (!gbOnHeap(buf)) {
+    if (gap + room < length) {
+      // a line that outgrows its inline chars is often loaded whole and
+      // never edited, so it only gets GB_MIN_ROOM until it grows again
+      char *elems = malloc((len + length + GB_MIN_ROOM) * sizeof(char));
+      assert(elems != NULL);
+      gbRehome(buf, elems, len + length + GB_MIN_ROOM);
+    }
+  } else if (gap + room < 2 * length + GB_MIN_ROOM) {
+    size_t capacity = 2 * (len + length) + GB_MIN_ROOM;
+    buf->elems = realloc(buf->elems, capacity * sizeof(char));
+    assert(buf->elems != NULL);
+    buf->capacity = capacity;
   }
-  return fprintf(fp, "%s", chars);
+  size_t spare = buf->capacity - len;
+  size_t new_gap = at_gap ? (spare / 2 > length ? spare / 2 : length)
+                          : (spare / 2 < spare - length ? spare / 2 : spare - length);
+  gbMoveTail(buf, buf->gap_start + new_gap);
 }
 
 /* Move the gap in the gap buffer to pos. */
 void gbMoveGap(GapBuffer *buf, int pos) {
   assert(pos >= 0 && pos <= gbLen(buf));
 
-  int headLength = buf->head.size;
-  if (pos < headLength) {
-    // Take the chars in head string after pos and prepend them to tail string
-    listExtendLeft(&buf->tail, &buf->head.elems[pos], buf->head.size - pos);
-    buf->head.size = pos;
-  } else if (pos > headLength) {
-    pos -= headLength;
-    // Append the first pos chars in tail string to head string
-    listExtend(&buf->head, buf->tail.elems, pos);
-    buf->tail.size -= pos;
-    // Shift the tail string chars after pos to the beginning
-    memmove(buf->tail.elems, &buf->tail.elems[pos], buf->tail.size * sizeof(char));
+  size_t p = pos;
+  if (buf->gap_start == buf->gap_end) {
+    // nothing to move, which also keeps borrowed chars as they are
+    buf->gap_start = buf->gap_end = p;
+    return;
+  }
+  if (buf->borrowed) gbOwn(buf);
+  if (p < buf->gap_start) {
+    // Move the chars between pos and the gap to after the gap
+    size_t n = buf->gap_start - p;
+    memmove(&buf->elems[buf->gap_end - n], &buf->elems[p], n * sizeof(char));
+    buf->gap_start -= n;
+    buf->gap_end -= n;
+  } else if (p > buf->gap_start) {
+    // Move the chars between the gap and pos to before the gap
+    size_t n = p - buf->gap_start;
+    memmove(&buf->elems[buf->gap_start], &buf->elems[buf->gap_end], n * sizeof(char));
+    buf->gap_start += n;
+    buf->gap_end += n;
   }
 }
 
 /* Inserts a character at the gap. */
 void gbInsertChar(GapBuffer *buf, char c) {
-  listAppend(&buf->head, c);
+  gbReserve(buf, 1, true);
+  buf->elems[buf->gap_start++] = c;
 }
 
 /* Inserts length characters at the gap. */
 void gbInsertChars(GapBuffer *buf, const char *cs, int length) {
-  listExtend(&buf->head, cs, length);
+  if (length <= 0) return;
+  gbReserve(buf, length, true);
+  memcpy(&buf->elems[buf->gap_start], cs, length * sizeof(char));
+  buf->gap_start += length;
 }
 
 /* Deletes the character before the gap. */
 char gbDeleteChar(GapBuffer *buf) {
-  assert(buf->head.size > 0);
-  return buf->head.elems[--buf->head.size];
+  assert(buf->gap_start > 0);
+  return buf->elems[--buf->gap_start];
 }
 
 /* Pushes a character to the end of the gap buffer. */
 void gbPushChar(GapBuffer *buf, char c) {
-  listAppend(&buf->tail, c);
+  gbReserve(buf, 1, false);
+  buf->elems[buf->end++] = c;
 }
 
 /* Pushes length characters to the end of the gap buffer. */
 void gbPushChars(GapBuffer *buf, const char *cs, int length) {
-  listExtend(&buf->tail, cs, length);
+  if (length <= 0) return;
+  gbReserve(buf, length, false);
+  memcpy(&buf->elems[buf->end], cs, length * sizeof(char));
+  buf->end += length;
 }
 
 /* Pops a character off the end of the gap buffer. */
 char gbPopChar(GapBuffer *buf) {
   assert(gbLen(buf) > 0);
-  if (buf->tail.size > 0) {
-    return buf->tail.elems[--buf->tail.size];
+  if (buf->end > buf->gap_end) {
+    return buf->elems[--buf->end];
   } else {
-    return buf->head.elems[--buf->head.size];
+    return buf->elems[--buf->gap_start];
   }
 }
 
 /* Appends the characters of src to dst. */
 void gbConcat(GapBuffer *dst, GapBuffer *src) {
-  gbPushChars(dst, src->head.elems, src->head.size);
-  gbPushChars(dst, src->tail.elems, src->tail.size);
+  gbPushChars(dst, src->elems, src->gap_start);
+  gbPushChars(dst, &src->elems[src->gap_end], src->end - src->gap_end);
 }
 
 /* Splits src at gap and pushes tail from src to dst. */
 void gbSplit(GapBuffer *dst, GapBuffer *src) {
-  gbPushChars(dst, src->tail.elems, src->tail.size);
-  listClear(&src->tail);
+  gbPushChars(dst, &src->elems[src->gap_end], src->end - src->gap_end);
+  gbClearTail(src);
 }
 
 void gbClearTail(GapBuffer *buf) {
-  listClear(&buf->tail);
+  buf->end = buf->gap_end;
+}
+
+/* Gives back the free room of a buffer that has much more of it than chars,
+ * keeping GB_MIN_ROOM, or moves its chars back inline if they fit. Meant
+ * to be called when the buffer is done being edited for a while. */
+void gbShrink(GapBuffer *buf) {
+  size_t len = gbLen(buf);
+  if (!gbOnHeap(buf)) return;
+  if (buf->has_inline && len <= GB_INLINE_CAPACITY) {
+    gbRehome(buf, gbInline(buf), GB_INLINE_CAPACITY);
+    return;
+  }
+  if (buf->capacity <= 2 * (len + GB_MIN_ROOM)) return;
+  gbMoveTail(buf, buf->gap_start + GB_MIN_ROOM / 2);
+  buf->capacity = len + GB_MIN_ROOM;
+  buf->elems = realloc(buf->elems, buf->capacity * sizeof(char));
+  assert(buf->elems != NULL);
 }
 
 char gbGetChar(GapBuffer *buf, int pos) {
   assert(gbLen(buf) > 0);
   assert(pos >= 0 && pos < gbLen(buf));
-  if (pos < buf->head.size) {
-    return buf->head.elems[pos];
+  if (pos < buf->gap_start) {
+    return buf->elems[pos];
   } else {
-    return buf->tail.elems[pos - buf->head.size];
+    return buf->elems[pos + buf->gap_end - buf->gap_start];
   }
 }
 
+/* Returns the chars of the gap buffer in a new NUL-terminated string. */
 char *gbGetChars(GapBuffer *buf) {
   char *line = malloc(gbLen(buf) + 1);
-  strcpy(line, buf->head.elems);
-  strcat(line, buf->tail.elems);
+  GbSpan spans[2];
+  int n = gbSpans(buf, spans);
+  size_t len = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(&line[len], spans[i].chars, spans[i].length);
+    len += spans[i].length;
+  }
+  line[len] = '\0';
   return line;
 }
 
-/* Creates a new gap buffer. */
+/* Sets spans to the runs of chars before and after the gap, leaving out
+ * empty ones. Returns the number of spans set, at most 2. */
+int gbSpans(GapBuffer *buf, GbSpan spans[2]) {
+  int n = 0;
+  if (buf->gap_start > 0) spans[n++] = (GbSpan) { buf->elems, buf->gap_start };
+  if (buf->end > buf->gap_end) spans[n++] = (GbSpan) { &buf->elems[buf->gap_end], buf->end - buf->gap_end };
+  return n;
+}
+
+/* Writes n lines to fd, each followed by a newline, straight from their
+ * spans with as few writev calls as IOV_MAX allows. Returns false if a
+ * write fails. */
+bool gbWriteLines(GapBuffer **lines, size_t n, int fd) {
+  static char newline = '\n';
+  struct iovec iov[IOV_MAX];
+  int count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (count + 3 > IOV_MAX) {
+      if (!writeAll(fd, iov, count)) return false;
+      count = 0;
+    }
+    GbSpan spans[2];
+    int k = gbSpans(lines[i], spans);
+    for (int j = 0; j < k; j++) {
+      iov[count].iov_base = (char *) spans[j].chars;
+      iov[count++].iov_len = spans[j].length;
+    }
+    iov[count].iov_base = &newline;
+    iov[count++].iov_len = 1;
+  }
+  return writeAll(fd, iov, count);
+}
+
+/* Creates a new gap buffer holding its chars inline. */
 GapBuffer *gbCreate(void) {
-  GapBuffer *gbNew = calloc(1, sizeof(GapBuffer));
+  GapBuffer *gbNew = calloc(1, sizeof(GapBuffer) + GB_INLINE_CAPACITY);
   assert(gbNew != NULL);
+  gbNew->elems = gbInline(gbNew);
+  gbNew->capacity = GB_INLINE_CAPACITY;
+  gbNew->has_inline = true;
   return gbNew;
 }
 
+/* Copies the chars of buf into a new gap buffer, inline if they fit and
+ * with no free room otherwise. */
 GapBuffer *gbCopy(GapBuffer *buf) {
   GapBuffer *gbCopy = gbCreate();
-  gbCopy->head = buf->head;
-  gbCopy->head.elems = malloc(buf->head.size * sizeof(char));
-  memcpy(gbCopy->head.elems, buf->head.elems, buf->head.size * sizeof(char));
-  gbCopy->tail = buf->tail;
-  gbCopy->tail.elems = malloc(buf->tail.size * sizeof(char));
-  memcpy(gbCopy->tail.elems, buf->tail.elems, buf->tail.size * sizeof(char));
+  size_t len = gbLen(buf);
+  if (len <= GB_INLINE_CAPACITY) {
+    gbConcat(gbCopy, buf);
+    return gbCopy;
+  }
+  gbCopy->elems = malloc(len * sizeof(char));
+  gbCopy->capacity = len;
+  gbPushChars(gbCopy, buf->elems, buf->gap_start);
+  gbPushChars(gbCopy, &buf->elems[buf->gap_end], buf->end - buf->gap_end);
   return gbCopy;
 }
 
 /* Frees the gap buffer. */
 void gbFree(GapBuffer *buf) {
-  free(buf->head.elems);
-  free(buf->tail.elems);
+  gbFreeChars(buf);
   free(buf);
 }
+
+/* Frees the heap block of a buffer that is not freed itself, such as one
+ * of the lines from gbSliceLines, and leaves it empty. */
+void gbFreeChars(GapBuffer *buf) {
+  if (gbOnHeap(buf)) free(buf->elems);
+  buf->elems = buf->has_inline ? gbInline(buf) : NULL;
+  buf->gap_start = buf->gap_end = buf->end = 0;
+  buf->capacity = buf->has_inline ? GB_INLINE_CAPACITY : 0;
+  buf->borrowed = false;
+}
+
+/* Sets up buf, which holds no chars of its own, to borrow the length
+ * chars at chars. They must stay valid and unchanged for as long as buf
+ * borrows them, and are copied the first time buf needs to change them. */
+void gbInitSlice(GapBuffer *buf, const char *chars, size_t length) {
+  *buf = (GapBuffer) { .elems = (char *) chars, .end = length, .capacity = length, .borrowed = true };
+}
+
+/* Returns an array of gap buffers for the lines of length chars of text,
+ * each borrowing its chars from text without the newline, and sets count
+ * to the number of lines. A last line with no newline is a line too, and
+ * empty text has one empty line. */
+GapBuffer *gbSliceLines(const char *text, size_t length, size_t *count) {
+  size_t newlines = nlCount(text, length);
+  size_t lines = newlines + (length == 0 || text[length - 1] != '\n');
+  GapBuffer *bufs = malloc(lines * sizeof(GapBuffer));
+  assert(bufs != NULL);
+
+  size_t offsets[1024];
+  size_t line = 0, start = 0, scanned = 0;
+  while (scanned < length) {
+    size_t step;
+    size_t n = nlLocate(&text[scanned], length - scanned, scanned, offsets, 1024, &step);
+    scanned += step;
+    for (size_t i = 0; i < n; i++) {
+      gbInitSlice(&bufs[line++], &text[start], offsets[i] - start);
+      start = offsets[i] + 1;
+    }
+  }
+  if (line < lines) gbInitSlice(&bufs[line++], &text[start], length - start);
+  *count = lines;
+  return bufs;
+}
@@ -3,20 +3,41 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 #include "list.h"
 
 // Basic gap buffer implementation
 // https://en.wikipedia.org/wiki/Gap_buffer
 
+// Free room to keep when a buffer grows or shrinks
+#define GB_MIN_ROOM 16
+
+// Chars a buffer from gbCreate holds right after itself before it
+// allocates, sized so that the two fill a 128 byte malloc chunk
+#define GB_INLINE_CAPACITY 72
+
+// The chars are kept in one allocation as elems[0, gap_start) followed by
+// elems[gap_end, end). Inserts go into the gap and pushes go after end, so
+// moving the gap only moves the chars between the old and new positions.
+// Short lines are kept inline, in the same allocation as the buffer, and
+// a buffer can also borrow its chars from a larger block, such as a whole
+// file, until it is changed. Buffers must not be copied by value.
 typedef struct {
-  char *elems;
-  size_t size;
+  char *elems;     // inline chars, a heap block or borrowed chars
+  size_t gap_start;
+  size_t gap_end;
+  size_t end;
   size_t capacity;
-} String;
+  bool has_inline; // GB_INLINE_CAPACITY chars follow the struct
+  bool borrowed;   // elems belongs to someone else and is only read
+} GapBuffer;
 
+// Run of chars inside a gap buffer, valid until the buffer is next changed
 typedef struct {
-  String head, tail;
-} GapBuffer;
+  const char *chars;
+  size_t length;
+} GbSpan;
 
 size_t gbLen(GapBuffer *buf);
 size_t gbPrint(GapBuffer *buf, FILE *fp);
@@ -30,8 +51,14 @@ char gbPopChar(GapBuffer *buf);
 void gbConcat(GapBuffer *buf1, GapBuffer *buf2);
 void gbSplit(GapBuffer *dst, GapBuffer *src);
 void gbClearTail(GapBuffer *buf);
+void gbShrink(GapBuffer *buf);
 char gbGetChar(GapBuffer *buf, int pos);
 char *gbGetChars(GapBuffer *buf);
+int gbSpans(GapBuffer *buf, GbSpan spans[2]);
+bool gbWriteLines(GapBuffer **lines, size_t n, int fd);
 GapBuffer *gbCreate(void);
 GapBuffer *gbCopy(GapBuffer *buf);
 void gbFree(GapBuffer *buf);
+void gbFreeChars(GapBuffer *buf);
+void gbInitSlice(GapBuffer *buf, const char *chars, size_t length);
+GapBuffer *gbSliceLines(const char *text, size_t length, size_t *count);
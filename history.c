@@ -0,0 +1,210 @@
+#include "history.h"
+
+/* Returns whether buf is one of the lines loaded from the file, which are
+ * freed all at once with the file. */
+bool linesIsFile(Lines *lines, GapBuffer *buf) {
+  return lines->fileCount > 0 && buf >= lines->file && buf < &lines->file[lines->fileCount];
+}
+
+/* Deletes and frees the gap buffer at line. */
+void linesRemove(Lines *lines, size_t line) {
+  GapBuffer *buf = lines->elems[line];
+  if (linesIsFile(lines, buf)) {
+    gbFreeChars(buf);
+  } else {
+    gbFree(buf);
+  }
+  listDelete(lines, line);
+}
+
+/* Returns the memory held by a command. */
+size_t cmdBytes(Command *cmd) {
+  return sizeof(Command) + cmd->removed.capacity + cmd->inserted.capacity;
+}
+
+/* Frees a command and takes it out of the history size. */
+void cmdFree(History *h, Command *cmd) {
+  h->bytes -= cmdBytes(cmd);
+  free(cmd->removed.elems);
+  free(cmd->inserted.elems);
+  free(cmd);
+}
+
+/* Appends the chars in [start, end) of gb to chars. */
+void charsAppendRange(Chars *chars, GapBuffer *gb, size_t start, size_t end) {
+  GbSpan spans[2];
+  int n = gbSpans(gb, spans);
+  size_t pos = 0;
+  for (int i = 0; i < n && pos < end; i++) {
+    size_t from = start > pos ? start - pos : 0;
+    size_t to = end < pos + spans[i].length ? end - pos : spans[i].length;
+    size_t length = to > from ? to - from : 0;
+    if (length > 0) listExtend(chars, &spans[i].chars[from], length);
+    pos += spans[i].length;
+  }
+}
+
+/* Drops the oldest undo steps while the history holds more than
+ * HISTORY_BYTE_LIMIT, always keeping the newest one. */
+void cmdTrim(History *h) {
+  Commands *cmds = &h->commands;
+  size_t drop = 0;
+  while (h->bytes > HISTORY_BYTE_LIMIT && drop < cmds->size &&
+         cmds->elems[drop]->group != cmds->elems[cmds->size - 1]->group) {
+    size_t group = cmds->elems[drop]->group;
+    while (drop < cmds->size && cmds->elems[drop]->group == group) {
+      cmdFree(h, cmds->elems[drop++]);
+    }
+  }
+  if (drop == 0) return;
+  memmove(cmds->elems, &cmds->elems[drop], (cmds->size - drop) * sizeof(Command *));
+  cmds->size -= drop;
+  h->pos -= drop;
+}
+
+/* Adds a command to the history, dropping the commands that could be
+ * redone. Returns the command for the caller to fill in. */
+Command *cmdPush(History *h, enum CommandType type, int line, int col) {
+  while (h->commands.size > h->pos) {
+    cmdFree(h, h->commands.elems[--h->commands.size]);
+  }
+  Command *cmd = calloc(1, sizeof(Command));
+  assert(cmd != NULL);
+  cmd->type = type;
+  cmd->line = line;
+  cmd->col = col;
+  cmd->group = h->group;
+  listAppend(&h->commands, cmd);
+  h->pos++;
+  h->bytes += cmdBytes(cmd);
+  return cmd;
+}
+
+/* Records that the chars in [col, end) of gb, which is at line, are about
+ * to be removed and length chars inserted there. A change that carries on
+ * from the last one of the same group, like typing or backspacing one
+ * char after another, is added to it. */
+void recordChange(History *h, int line, GapBuffer *gb, int col, int end, const char *chars, size_t length) {
+  Command *last = h->pos > 0 && h->pos == h->commands.size ? h->commands.elems[h->pos - 1] : NULL;
+  if (last && (last->type != LineChange || last->group != h->group || last->line != line)) last = NULL;
+
+  if (last && end == col && last->col + (int) last->inserted.size == col) {
+    // typing on after the chars typed so far
+    h->bytes -= cmdBytes(last);
+    listExtend(&last->inserted, chars, length);
+    h->bytes += cmdBytes(last);
+    cmdTrim(h);
+    return;
+  }
+  if (last && length == 0 && end == col + 1 && last->inserted.size > 0 &&
+      last->col + (int) last->inserted.size == end) {
+    // backspacing over a char typed in this group
+    last->inserted.size--;
+    return;
+  }
+  if (last && length == 0 && end == last->col && last->inserted.size == 0) {
+    // backspacing on before the chars removed so far
+    h->bytes -= cmdBytes(last);
+    Chars removed = { 0 };
+    charsAppendRange(&removed, gb, col, end);
+    listExtendLeft(&last->removed, removed.elems, removed.size);
+    free(removed.elems);
+    last->col = col;
+    h->bytes += cmdBytes(last);
+    cmdTrim(h);
+    return;
+  }
+
+  Command *cmd = cmdPush(h, LineChange, line, col);
+  h->bytes -= cmdBytes(cmd);
+  charsAppendRange(&cmd->removed, gb, col, end);
+  if (length > 0) listExtend(&cmd->inserted, chars, length);
+  h->bytes += cmdBytes(cmd);
+  cmdTrim(h);
+}
+
+/* Records that gb is about to be inserted at line. */
+void recordCreate(History *h, int line, GapBuffer *gb) {
+  Command *cmd = cmdPush(h, LineCreate, line, 0);
+  h->bytes -= cmdBytes(cmd);
+  charsAppendRange(&cmd->inserted, gb, 0, gbLen(gb));
+  h->bytes += cmdBytes(cmd);
+  cmdTrim(h);
+}
+
+/* Records that gb, which is at line, is about to be deleted. */
+void recordDestroy(History *h, int line, GapBuffer *gb) {
+  Command *cmd = cmdPush(h, LineDestroy, line, 0);
+  h->bytes -= cmdBytes(cmd);
+  charsAppendRange(&cmd->removed, gb, 0, gbLen(gb));
+  h->bytes += cmdBytes(cmd);
+  cmdTrim(h);
+}
+
+/* Replaces the remove chars at col of line with length chars. */
+void applyChange(Lines *lines, int line, int col, size_t remove, const char *chars, size_t length) {
+  GapBuffer *gb = lines->elems[line];
+  gbMoveGap(gb, col + remove);
+  for (size_t i = 0; i < remove; i++) gbDeleteChar(gb);
+  gbInsertChars(gb, chars, length);
+}
+
+/* Inserts a line holding length chars at line. */
+void applyCreate(Lines *lines, int line, const char *chars, size_t length) {
+  GapBuffer *gb = gbCreate();
+  gbPushChars(gb, chars, length);
+  listInsert(lines, gb, line);
+}
+
+/* Undoes cmd, or does it again when undo is false. */
+void cmdApply(Lines *lines, Command *cmd, bool undo) {
+  Chars *before = undo ? &cmd->inserted : &cmd->removed;
+  Chars *after = undo ? &cmd->removed : &cmd->inserted;
+  bool create = cmd->type == (undo ? LineDestroy : LineCreate);
+  switch (cmd->type) {
+    case LineChange:
+      applyChange(lines, cmd->line, cmd->col, before->size, after->elems, after->size);
+      break;
+    case LineCreate:
+    case LineDestroy:
+      if (create) {
+        applyCreate(lines, cmd->line, after->elems, after->size);
+      } else {
+        linesRemove(lines, cmd->line);
+      }
+      break;
+  }
+}
+
+/* Undoes the last group of commands on lines. Returns the last command
+ * undone, or NULL if there was nothing to undo. */
+Command *historyUndo(History *h, Lines *lines) {
+  if (h->pos == 0) return NULL;
+  size_t group = h->commands.elems[h->pos - 1]->group;
+  Command *cmd;
+  do {
+    cmd = h->commands.elems[--h->pos];
+    cmdApply(lines, cmd, true);
+  } while (h->pos > 0 && h->commands.elems[h->pos - 1]->group == group);
+  return cmd;
+}
+
+/* Does the last undone group of commands on lines again. Returns the last
+ * command redone, or NULL if there was nothing to redo. */
+Command *historyRedo(History *h, Lines *lines) {
+  if (h->pos >= h->commands.size) return NULL;
+  size_t group = h->commands.elems[h->pos]->group;
+  Command *cmd;
+  do {
+    cmd = h->commands.elems[h->pos++];
+    cmdApply(lines, cmd, false);
+  } while (h->pos < h->commands.size && h->commands.elems[h->pos]->group == group);
+  return cmd;
+}
+
+/* Frees the whole history. */
+void historyClear(History *h) {
+  for (size_t i = 0; i < h->commands.size; i++) cmdFree(h, h->commands.elems[i]);
+  listClear(&h->commands);
+  h->pos = 0;
+}
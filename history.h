@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "list.h"
+#include "gapbuffer.h"
+
+// Undo and redo of changes to lines of gap buffers, kept apart from the
+// editor so that it can be run without a terminal.
+// Command pattern for undo/redo based on line changes:
+// https://en.wikipedia.org/wiki/Undo#Undo_implementation
+
+// Memory the history can hold before the oldest undo steps are dropped
+#ifndef HISTORY_BYTE_LIMIT
+#define HISTORY_BYTE_LIMIT (4 * 1024 * 1024)
+#endif
+
+// Stores the lines of the files as an array of gap buffers. The lines
+// loaded from a file are in one array of their own, file, and are freed
+// all at once with it.
+typedef struct {
+  GapBuffer **elems;
+  size_t size;
+  size_t capacity;
+  GapBuffer *file;  // Loaded lines, in file order
+  size_t fileCount; // Number of lines in file
+} Lines;
+
+enum CommandType {
+  LineChange,  // removed chars at col of line were replaced by inserted
+  LineCreate,  // line was inserted holding inserted
+  LineDestroy, // line holding removed was deleted
+};
+
+// Chars taken out or put in by a command
+typedef struct {
+  char *elems;
+  size_t size;
+  size_t capacity;
+} Chars;
+
+// Information on the change. Commands with the same group are undone and
+// redone together, such as everything typed in one visit to insert mode.
+typedef struct {
+  enum CommandType type;
+  int line;
+  int col;
+  Chars removed;
+  Chars inserted;
+  size_t group;
+} Command;
+
+// List of commands
+typedef struct {
+  Command **elems;
+  size_t size;
+  size_t capacity;
+} Commands;
+
+// History (stack) of commands for undo/redo
+typedef struct {
+  Commands commands; // Oldest command first
+  size_t pos;        // Number of commands that can be undone
+  size_t group;      // Group given to new commands
+  size_t bytes;      // Memory held by the commands
+} History;
+
+bool linesIsFile(Lines *lines, GapBuffer *buf);
+void linesRemove(Lines *lines, size_t line);
+void recordChange(History *h, int line, GapBuffer *gb, int col, int end, const char *chars, size_t length);
+void recordCreate(History *h, int line, GapBuffer *gb);
+void recordDestroy(History *h, int line, GapBuffer *gb);
+Command *historyUndo(History *h, Lines *lines);
+Command *historyRedo(History *h, Lines *lines);
+void historyClear(History *h);
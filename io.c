@@ -0,0 +1,29 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "io.h"
+
+/* Writes n iovecs to fd, carrying on after partial writes. Returns false
+ * on failure. */
+bool writeAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    // skip what was written, which can end in the middle of an iovec
+    while (n > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,11 @@
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+// Writing to file descriptors, shared by the piece table and the gap buffer
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+bool writeAll(int fd, struct iovec *iov, int n);
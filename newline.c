@@ -0,0 +1,138 @@
+#include "newline.h"
+
+#include <stdint.h>
+
+#ifdef NL_X86
+#include <immintrin.h>
+#endif
+
+/* Returns the number of newlines in length chars. */
+size_t nlCountScalar(const char *chars, size_t length) {
+  size_t count = 0;
+  for (size_t i = 0; i < length; i++) count += chars[i] == '\n';
+  return count;
+}
+
+/* Stores base plus the position of each newline in length chars in offsets,
+ * stopping when max have been stored. Returns the number stored, and sets
+ * scanned to how many chars were looked at, which is length unless offsets
+ * ran out of room. */
+size_t nlLocateScalar(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned) {
+  size_t found = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (chars[i] != '\n') continue;
+    if (found == max) {
+      *scanned = i;
+      return found;
+    }
+    offsets[found++] = base + i;
+  }
+  *scanned = length;
+  return found;
+}
+
+#ifdef NL_X86
+
+// The vector versions compare a block of chars with '\n' at once, and
+// either add up the matches in byte counters, emptied before they can
+// overflow, or go through the bits of the mask of matches.
+
+__attribute__((target("sse2")))
+size_t nlCountSse2(const char *chars, size_t length) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t count = 0, i = 0;
+  while (i + 16 <= length) {
+    __m128i counters = _mm_setzero_si128();
+    for (int n = 0; n < 255 && i + 16 <= length; n++, i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *) &chars[i]);
+      // matching bytes are -1
+      counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, newline));
+    }
+    __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+    count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+  }
+  return count + nlCountScalar(&chars[i], length - i);
+}
+
+__attribute__((target("sse2")))
+size_t nlLocateSse2(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t found = 0, i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) &chars[i]);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    for (; mask != 0; mask &= mask - 1) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (found == max) {
+        *scanned = pos;
+        return found;
+      }
+      offsets[found++] = base + pos;
+    }
+  }
+  size_t tail;
+  found += nlLocateScalar(&chars[i], length - i, base + i, &offsets[found], max - found, &tail);
+  *scanned = i + tail;
+  return found;
+}
+
+__attribute__((target("avx2")))
+size_t nlCountAvx2(const char *chars, size_t length) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t count = 0, i = 0;
+  while (i + 32 <= length) {
+    __m256i counters = _mm256_setzero_si256();
+    for (int n = 0; n < 255 && i + 32 <= length; n++, i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *) &chars[i]);
+      counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, newline));
+    }
+    __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + nlCountScalar(&chars[i], length - i);
+}
+
+__attribute__((target("avx2")))
+size_t nlLocateAvx2(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t found = 0, i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) &chars[i]);
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+    for (; mask != 0; mask &= mask - 1) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (found == max) {
+        *scanned = pos;
+        return found;
+      }
+      offsets[found++] = base + pos;
+    }
+  }
+  size_t tail;
+  found += nlLocateScalar(&chars[i], length - i, base + i, &offsets[found], max - found, &tail);
+  *scanned = i + tail;
+  return found;
+}
+
+#endif
+
+/* Returns the number of newlines in length chars with the fastest version
+ * the CPU supports. */
+size_t nlCount(const char *chars, size_t length) {
+#ifdef NL_X86
+  if (__builtin_cpu_supports("avx2")) return nlCountAvx2(chars, length);
+  if (__builtin_cpu_supports("sse2")) return nlCountSse2(chars, length);
+#endif
+  return nlCountScalar(chars, length);
+}
+
+/* Locates the newlines in length chars like nlLocateScalar, with the
+ * fastest version the CPU supports. */
+size_t nlLocate(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned) {
+#ifdef NL_X86
+  if (__builtin_cpu_supports("avx2")) return nlLocateAvx2(chars, length, base, offsets, max, scanned);
+  if (__builtin_cpu_supports("sse2")) return nlLocateSse2(chars, length, base, offsets, max, scanned);
+#endif
+  return nlLocateScalar(chars, length, base, offsets, max, scanned);
+}
@@ -0,0 +1,17 @@
+#include <stddef.h>
+
+// Finding and counting '\n' chars a vector at a time. The SSE2 and AVX2
+// versions are picked at run time on x86-64, with a scalar one elsewhere.
+
+size_t nlCount(const char *chars, size_t length);
+size_t nlLocate(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned);
+
+size_t nlCountScalar(const char *chars, size_t length);
+size_t nlLocateScalar(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned);
+#ifdef __x86_64__
+#define NL_X86 1
+size_t nlCountSse2(const char *chars, size_t length);
+size_t nlLocateSse2(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned);
+size_t nlCountAvx2(const char *chars, size_t length);
+size_t nlLocateAvx2(const char *chars, size_t length, size_t base, size_t *offsets, size_t max, size_t *scanned);
+#endif
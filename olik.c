@@ -3,12 +3,14 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include "list.h"
-#include "gapbuffer.h"
+#include "history.h"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -21,7 +23,6 @@
      - after certain period of inactivity, save to disk and reload for short change list
    - repeat changes
    - truncate visible text to screen width
-   - undo/redo
    - change/delete word
    - searching
    - zz position screen
@@ -31,39 +32,8 @@
    - replace/delete char
    - deal with tabs
    - skip list for lines
-   - free lines after closing file
 */
 
-// Stores the lines of the files as an array of gap buffers
-typedef struct {
-  GapBuffer **elems;
-  size_t size;
-  size_t capacity;
-} Lines;
-
-// Command pattern for undo/redo based on line changes:
-// https://en.wikipedia.org/wiki/Undo#Undo_implementation
-
-enum CommandType {
-  LineChange,
-  LineCreate,
-  LineDestroy,
-};
-
-// Information on the change
-typedef struct {
-  enum CommandType type;
-  GapBuffer *buf;
-  int line;
-} Command;
-
-// List of commands
-typedef struct {
-  Command **elems;
-  size_t size;
-  size_t capacity;
-} Commands;
-
 enum EditorMode { Normal, Insert };
 
 // Editor state and contents
@@ -75,8 +45,8 @@ typedef struct {
   enum EditorMode mode; // Current mode of the editor
   bool fileOpen;        // Whether a file is open
   char *fileName;       // Name of the open file
-  Commands commands;    // History (stack) of commands for undo/redo
-  int cmdPos;           // Position of the current command
+  History history;      // Commands for undo/redo
+  char *fileText;       // Contents of the file, which loaded lines borrow until edited
 } Editor;
 
 struct termios orig_termios;
@@ -175,27 +145,12 @@ void linesInsert(Editor *e, GapBuffer *buf, int row) {
 
 /* Deletes and frees the gap buffer at pos in lines. */
 void linesDelete(Editor *e, int row) {
-  row += e->offset;
-  gbFree(e->lines.elems[row]);
-  listDelete(&e->lines, row);
-}
-
-Command *cmdCreate(enum CommandType type, int line, GapBuffer *gb) {
-  Command *cmd = malloc(sizeof(Command));
-  cmd->type = type;
-  cmd->line = line;
-  cmd->buf = gbCopy(gb);
-  return cmd;
-}
-
-void cmdPush(Editor *e, Command *cmd) {
-  listAppend(&e->commands, cmd);
-  e->cmdPos++;
+  linesRemove(&e->lines, row + e->offset);
 }
 
 /* Returns the gap buffer at the given row. */
 GapBuffer *getRow(Editor *e, int row) {
-  if (row < e->lines.size)
+  if (row + e->offset < e->lines.size)
     return e->lines.elems[row + e->offset];
   return NULL;
 }
@@ -498,6 +453,11 @@ void backspace(Editor *e) {
     // Backspace at start of line
     GapBuffer *gbPrev = getRow(e, e->row - 1);
     size_t prevLen = gbLen(gbPrev);
+    int line = e->row + e->offset;
+    char *chars = gbGetChars(gbCur);
+    recordChange(&e->history, line - 1, gbPrev, prevLen, prevLen, chars, gbLen(gbCur));
+    free(chars);
+    recordDestroy(&e->history, line, gbCur);
     // Append current line to the end of previous line
     gbConcat(gbPrev, gbCur);
     // Delete current line
@@ -509,11 +469,13 @@ void backspace(Editor *e) {
     renderLinesAfter(e, e->row);
   } else if (e->col == gbLen(gbCur)) {
     // Backspace at end of line
+    recordChange(&e->history, e->row + e->offset, gbCur, e->col - 1, e->col, NULL, 0);
     gbPopChar(gbCur);
     e->col--;
     renderLine(e);
   } else if (e->col < gbLen(gbCur)) {
     // Backspace in the middle of the line
+    recordChange(&e->history, e->row + e->offset, gbCur, e->col - 1, e->col, NULL, 0);
     gbMoveGap(gbCur, e->col);
     gbDeleteChar(gbCur);
     e->col--;
@@ -524,10 +486,13 @@ void backspace(Editor *e) {
 /* Handle new line (enter). */
 void newLine(Editor *e) {
   GapBuffer *gbCur = getRow(e, e->row);
+  int line = e->row + e->offset;
+  recordChange(&e->history, line, gbCur, e->col, gbLen(gbCur), NULL, 0);
   gbMoveGap(gbCur, e->col);
   GapBuffer *gbNew = gbCreate();
   // Split the current line at col, and put the second half in gbNew
   gbSplit(gbNew, gbCur);
+  recordCreate(&e->history, line + 1, gbNew);
   renderLine(e);
 
   if (e->row + e->offset == e->lines.size) {
@@ -545,6 +510,7 @@ void newLine(Editor *e) {
 /* Creates a new line on the next line. */
 void newLineNext(Editor *e) {
   GapBuffer *gbNew = gbCreate();
+  recordCreate(&e->history, e->row + e->offset + 1, gbNew);
   if (e->row + e->offset == e->lines.size) {
     // If its the last line, just append
     listAppend(&e->lines, gbNew);
@@ -561,6 +527,7 @@ void newLineNext(Editor *e) {
 /* Creates a new line on the current line. */
 void newLineCurrent(Editor *e) {
   GapBuffer *gbNew = gbCreate();
+  recordCreate(&e->history, e->row + e->offset, gbNew);
   listInsert(&e->lines, gbNew, e->row + e->offset);
   e->col = 0;
   renderLinesAfter(e, e->row);
@@ -569,36 +536,53 @@ void newLineCurrent(Editor *e) {
 
 /* Load file into editor buffer. */
 void loadFile(Editor *e) {
-  FILE *fp;
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
-
-  fp = fopen(e->fileName, "r");
-  if (fp == NULL) die("fopen");
-
-  while ((read = getline(&line, &len, fp)) != -1) {
-    GapBuffer *gbNew = gbCreate();
-    gbPushChars(gbNew, line, read - 1);
-    listAppend(&e->lines, gbNew);
+  int fd = open(e->fileName, O_RDONLY);
+  if (fd == -1) die("open");
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("fstat");
+
+  // Read the whole file into one block that the lines borrow from
+  size_t length = st.st_size;
+  e->fileText = malloc(length > 0 ? length : 1);
+  if (e->fileText == NULL) die("malloc");
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = read(fd, &e->fileText[done], length - done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) die("read");
+    done += n;
   }
+  close(fd);
 
-  fclose(fp);
-  free(line);
+  e->lines.file = gbSliceLines(e->fileText, length, &e->lines.fileCount);
+  for (size_t i = 0; i < e->lines.fileCount; i++) {
+    listAppend(&e->lines, &e->lines.file[i]);
+  }
   renderLinesAfter(e, 0);
 }
 
-/* Save editor buffer into file. */
-void saveFile(Editor *e) {
-  FILE *fp;
-  fp = fopen(e->fileName, "w");
-
-  for (int i = 0; i < e->lines.size; i++) {
-    gbPrint(e->lines.elems[i], fp);
-    fprintf(fp, "\n");
+/* Frees the lines and the file they were loaded from. */
+void closeFile(Editor *e) {
+  historyClear(&e->history);
+  for (size_t i = 0; i < e->lines.size; i++) {
+    if (!linesIsFile(&e->lines, e->lines.elems[i])) gbFree(e->lines.elems[i]);
   }
+  // loaded lines that were replaced still hold chars of their own
+  for (size_t i = 0; i < e->lines.fileCount; i++) gbFreeChars(&e->lines.file[i]);
+  free(e->lines.file);
+  free(e->fileText);
+  e->lines.file = NULL;
+  e->fileText = NULL;
+  e->lines.fileCount = 0;
+  e->lines.size = 0;
+}
 
-  fclose(fp);
+/* Save editor buffer into file. */
+void saveFile(Editor *e) {
+  int fd = open(e->fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return;
+  gbWriteLines(e->lines.elems, e->lines.size, fd);
+  close(fd);
 }
 
 /* Write a character to the terminal screen. */
@@ -607,8 +591,7 @@ void writeCh(Editor *e, char ch) {
   int lineLength = gbLen(gb);
   assert(e->col <= lineLength);
 
-  // TODO: free these lines
-  cmdPush(e, cmdCreate(LineChange, e->row + e->offset, gb));
+  recordChange(&e->history, e->row + e->offset, gb, e->col, e->col, &ch, 1);
 
   if (e->col == lineLength) {
     // If at the end, just append
@@ -631,6 +614,7 @@ void tab(Editor *e) {
 
 /* Deletes the line. */
 void deleteLine(Editor *e) {
+  recordDestroy(&e->history, e->row + e->offset, getRow(e, e->row));
   linesDelete(e, e->row);
   renderLinesAfter(e, e->row);
   if (e->row + e->offset == e->lines.size) cursorUp(e, 1);
@@ -658,6 +642,7 @@ void change(Editor *e) {
 
 void deleteRestLine(Editor *e) {
   GapBuffer *gb = getRow(e, e->row);
+  recordChange(&e->history, e->row + e->offset, gb, e->col, gbLen(gb), NULL, 0);
   gbMoveGap(gb, e->col);
   gbClearTail(gb);
   renderLine(e);
@@ -668,37 +653,39 @@ void changeRestLine(Editor *e) {
   e->mode = Insert;
 }
 
-void undo(Editor *e) {
-  // recursive call
-  if (e->cmdPos <= 0) return;
-  Command *cmd = e->commands.elems[--e->cmdPos];
-
-  // Move screen so that line is at middle
-  e->offset = cmd->line - e->height / 2;
-  if (e->offset < 0) e->offset = 0;
-
-  switch (cmd->type) {
-    case LineChange:
-      e->lines.elems[cmd->line] = cmd->buf;
-      break;
-    case LineCreate:
-      break;
-    case LineDestroy:
-      break;
-    default: return;
+/* Moves the cursor to col of line, scrolling it into view. */
+void moveTo(Editor *e, int line, int col) {
+  if (e->lines.size == 0) return;
+  if (line >= (int) e->lines.size) line = e->lines.size - 1;
+  if (line < e->offset || line >= e->offset + e->height) {
+    // Move screen so that line is at middle
+    e->offset = line - e->height / 2;
+    if (e->offset < 0) e->offset = 0;
   }
-
+  e->row = line - e->offset;
+  int cols = gbLen(e->lines.elems[line]);
+  e->col = col < cols ? col : cols;
   renderScreen(e);
-  size_t cols = gbLen(getRow(e, e->row));
-  if (e->col > cols) {
-    e->col = cols;
-    setCursorCol(e->col);
-  }
+}
+
+/* Undoes the last group of commands. */
+void undo(Editor *e) {
+  Command *cmd = historyUndo(&e->history, &e->lines);
+  if (cmd) moveTo(e, cmd->line, cmd->col);
+}
+
+/* Does the last undone group of commands again. */
+void redo(Editor *e) {
+  Command *cmd = historyRedo(&e->history, &e->lines);
+  if (cmd) moveTo(e, cmd->line, cmd->col + cmd->inserted.size);
 }
 
 /* Handle the next character input. */
 bool processChar(Editor *e, char c) {
   if (e->mode == Normal) {
+    // Each normal mode key is one undo step, along with the insert mode
+    // session it starts
+    e->history.group++;
     // Deal with normal mode keys
     switch (c) {
       case 'q':
@@ -740,6 +727,8 @@ bool processChar(Editor *e, char c) {
         break;
       case 'u':
         undo(e); break;
+      case CTRL_KEY('r'):
+        redo(e); break;
       case 'o':
         newLineNext(e); break;
       case 'O':
@@ -779,6 +768,8 @@ bool processChar(Editor *e, char c) {
     } else {
       switch (c) {
         case 27: // Esc
+          // give back the room the line grew while typing
+          gbShrink(getRow(e, e->row));
           e->mode = Normal; break;
         case 127: // Backspace
           backspace(e); break;
@@ -821,6 +812,10 @@ int main(int argc, char *argv[]) {
     quit = processChar(e, getCh());
     //debugEditor(e);
   };
+  closeFile(e);
+  free(e->lines.elems);
+  free(e->history.commands.elems);
+  free(e);
 
   return 0;
 }
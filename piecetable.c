@@ -1,284 +1,1525 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "piecetable.h"
+#include "newline.h"
+#include "utf8.h"
+#include "io.h"
 #include "list.h"
 
-#define DEBUG 1
-
-#ifndef DEBUG
-#define DEBUG 0
+// Tracing is built in with -DPT_TRACE=1. Without it the counters and events
+// compile to nothing.
+#ifndef PT_TRACE
+#define PT_TRACE 0
 #endif
-#define debug_print(str, ...) printf("[DEBUG] %s:%d "str"\n", __FILE__, __LINE__, __VA_ARGS__)
+#if PT_TRACE
+#define traceCount(pt, counter) ((pt)->stats.counter++)
+#define traceEvent(pt, kind, index, length) traceRecord((pt), (kind), (index), (length))
+#else
+#define traceCount(pt, counter) ((void) 0)
+#define traceEvent(pt, kind, index, length) ((void) 0)
+#endif
+
+#define LEAF(node) ((PieceLeaf *) (node))
+#define INNER(node) ((PieceInner *) (node))
 
 // Reference: https://www.catch22.net/tuts/neatpad/piece-chains/
 
-Piece *pieceCreate(size_t offset, size_t length, WhichBuffer which) {
-  Piece *p = calloc(1, sizeof(Piece));
-  p->which = which;
-  p->offset = offset;
-  p->length = length;
-  return p;
+const char *trace_names[] = { "insert", "delete", "replace", "undo", "redo", "apply-edits", "compact" };
+
+/* Adds an event to the trace ring of pt, overwriting the oldest one when
+ * the ring is full. Only the thread using pt writes to the ring, and the
+ * count of events is published after the event so that it can be dumped
+ * from another thread. */
+void traceRecord(PieceTable *pt, TraceKind kind, size_t index, size_t length) {
+  TraceRing *ring = pt->trace;
+  if (ring == NULL) return;
+  size_t head = ring->head;
+  ring->events[head % PT_TRACE_EVENTS] = (TraceEvent) { kind, index, length };
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
-void pieceAppend(PieceRange *pr, Piece *piece) {
-  if (pr->first == NULL) {
-    pr->first = piece;
-  } else {
-    pr->last->next = piece;
-    piece->prev = pr->last;
+size_t minSize(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+/* Returns the position of the first newline at or after offset in the
+ * buffer's newline offsets. */
+size_t bufferNewlineAt(Buffer *buf, size_t offset) {
+  size_t lo = 0, hi = buf->newlines.size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (buf->newlines.elems[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
-  pr->last = piece;
+  return lo;
 }
 
-void pieceRemove(Piece *piece) {
-  piece->prev->next = piece->next;
-  piece->next->prev = piece->prev;
-  free(piece);
+/* Indexes the newlines of length chars stored at offset in the buffer. */
+void bufferIndex(Buffer *buf, const char *chars, size_t offset, size_t length) {
+  Offsets *newlines = &buf->newlines;
+  size_t scanned = 0;
+  while (scanned < length) {
+    if (newlines->size == newlines->capacity) {
+      newlines->capacity = newlines->capacity == 0 ? LIST_INIT_CAPACITY : newlines->capacity * 2;
+      newlines->elems = realloc(newlines->elems, newlines->capacity * sizeof(size_t));
+    }
+    size_t n;
+    newlines->size += nlLocate(&chars[scanned], length - scanned, offset + scanned,
+                               &newlines->elems[newlines->size], newlines->capacity - newlines->size, &n);
+    scanned += n;
+  }
 }
 
-PieceRange *rangeCreate(PieceTable *pt, Piece *first, Piece *last, bool boundary) {
-  PieceRange *pr = malloc(sizeof(PieceRange));
-  pr->first = first;
-  pr->last = last;
-  pr->boundary = boundary;
-  pr->sequence_length = pt->sequence_length;
-  return pr;
+/* Returns the segment containing offset. */
+Segment *bufferSegment(Buffer *buf, size_t offset) {
+  size_t lo = 0, hi = buf->segments.size - 1;
+  while (lo < hi) {
+    size_t mid = hi - (hi - lo) / 2;
+    if (buf->segments.elems[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return &buf->segments.elems[lo];
+}
+
+const char *bufferChars(Buffer *buf, size_t offset) {
+  Segment *segment = bufferSegment(buf, offset);
+  return &segment->elems[offset - segment->offset];
+}
+
+/* Samples the metrics of the chars in segment from from on, which must be
+ * the last segment of the buffer. */
+void bufferMeasure(Buffer *buf, Segment *segment, size_t from) {
+  if (from == 0) {
+    segment->sample = buf->samples.size;
+    listAppend(&buf->samples, buf->total);
+  }
+  for (size_t pos = from; pos < segment->size;) {
+    size_t next = minSize((pos / PT_METRICS_BLOCK + 1) * PT_METRICS_BLOCK, segment->size);
+    buf->total.codepoints += utf8Count(&segment->elems[pos], next - pos);
+    buf->total.width += utf8Width(&segment->elems[pos], next - pos, minSize(pos, 3));
+    if (next % PT_METRICS_BLOCK == 0) listAppend(&buf->samples, buf->total);
+    pos = next;
+  }
+}
+
+/* Returns the metrics of the buffer before offset. */
+TextMetrics bufferMetricsAt(Buffer *buf, size_t offset) {
+  Segment *segment = bufferSegment(buf, offset);
+  size_t in_segment = offset - segment->offset;
+  size_t block = in_segment / PT_METRICS_BLOCK * PT_METRICS_BLOCK;
+  TextMetrics metrics = buf->samples.elems[segment->sample + in_segment / PT_METRICS_BLOCK];
+  metrics.codepoints += utf8Count(&segment->elems[block], in_segment - block);
+  metrics.width += utf8Width(&segment->elems[block], in_segment - block, minSize(block, 3));
+  return metrics;
+}
+
+/* Returns the metrics of length chars at offset of the buffer. */
+TextMetrics bufferMetrics(Buffer *buf, size_t offset, size_t length) {
+  if (length == 0) return (TextMetrics) {0};
+  if (length < PT_METRICS_BLOCK) {
+    // counting the chars is quicker than counting from two samples
+    Segment *segment = bufferSegment(buf, offset);
+    size_t in_segment = offset - segment->offset;
+    const char *chars = &segment->elems[in_segment];
+    return (TextMetrics) { utf8Count(chars, length), utf8Width(chars, length, minSize(in_segment, 3)) };
+  }
+  TextMetrics start = bufferMetricsAt(buf, offset);
+  TextMetrics end = bufferMetricsAt(buf, offset + length);
+  return (TextMetrics) { end.codepoints - start.codepoints, end.width - start.width };
+}
+
+/* Makes the buffer refer to length chars it does not own. */
+void bufferBorrow(Buffer *buf, const char *chars, size_t length) {
+  if (length == 0) return;
+  Segment segment = {
+    .elems = (char *) chars,
+    .size = length,
+    .capacity = length,
+    .kind = Borrowed,
+  };
+  listAppend(&buf->segments, segment);
+  buf->size = length;
+  bufferIndex(buf, chars, 0, length);
+  bufferMeasure(buf, &buf->segments.elems[0], 0);
+}
+
+/* Maps an unlinked temporary file of length chars, so that a large append
+ * is paged out by the kernel instead of held in memory. Returns NULL on
+ * failure. */
+char *bufferSpill(size_t length) {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/olik-XXXXXX", dir ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd == -1) return NULL;
+  unlink(path);
+  char *chars = NULL;
+  if (ftruncate(fd, length) == 0) {
+    chars = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (chars == MAP_FAILED) chars = NULL;
+  }
+  close(fd);
+  return chars;
 }
 
-void rangeExtend(PieceRange *src, PieceRange *dest) {
-  if (!src->boundary) {
-    if (dest->boundary) {
-      dest->first = src->first;
-      dest->last = src->last;
-      dest->boundary = false;
+/* Appends length chars to the buffer and indexes their newlines and
+ * metrics. Returns the offset the chars were stored at. */
+size_t bufferAppend(Buffer *buf, const char *chars, size_t length) {
+  Segment *last = buf->segments.size > 0 ? &buf->segments.elems[buf->segments.size - 1] : NULL;
+  if (last == NULL || last->kind != Allocated || last->capacity - last->size < length) {
+    // start a new segment; appends longer than a segment get one to themselves
+    Segment segment = {
+      .offset = last == NULL ? 0 : buf->size + 1,
+      .capacity = length > PT_SEGMENT_CAPACITY ? length : PT_SEGMENT_CAPACITY,
+      .kind = Allocated,
+    };
+    if (length >= PT_SPILL_LENGTH && (segment.elems = bufferSpill(length))) {
+      segment.kind = Mapped;
     } else {
-      src->last->next = dest->first;
-      dest->first->prev = src->last;
-      dest->first = src->first;
+      segment.elems = malloc(segment.capacity);
     }
+    listAppend(&buf->segments, segment);
+    last = &buf->segments.elems[buf->segments.size - 1];
   }
+
+  size_t offset = last->offset + last->size;
+  size_t from = last->size;
+  memcpy(&last->elems[last->size], chars, length);
+  last->size += length;
+  buf->size = offset + length;
+  bufferIndex(buf, &last->elems[offset - last->offset], offset, length);
+  bufferMeasure(buf, last, from);
+  return offset;
+}
+
+/* Releases the chars of a segment. Its place in the buffer's offsets is
+ * kept, with no chars left in it. */
+void segmentFree(Segment *segment) {
+  if (segment->kind == Allocated) free(segment->elems);
+  if (segment->kind == Mapped) munmap(segment->elems, segment->capacity);
+  segment->elems = NULL;
+  segment->size = 0;
+  segment->capacity = 0;
+  segment->kind = Allocated;
 }
 
-void rangeSwap(PieceRange *src, PieceRange *dest) {
-  if (src->boundary) {
-    if (!dest->boundary) {
-      src->first->next = dest->first;
-      src->last->prev  = dest->last;
-      dest->first->prev = src->first;
-      dest->last->next  = src->last;
+void bufferFree(Buffer *buf) {
+  for (size_t i = 0; i < buf->segments.size; i++) segmentFree(&buf->segments.elems[i]);
+  free(buf->segments.elems);
+  free(buf->newlines.elems);
+  free(buf->samples.elems);
+}
+
+Buffer *pieceBuffer(PieceTable *pt, Piece *piece) {
+  return piece->which == Original ? &pt->original : &pt->add;
+}
+
+const char *pieceChars(PieceTable *pt, Piece *piece) {
+  return bufferChars(pieceBuffer(pt, piece), piece->offset);
+}
+
+/* Creates a piece referring to length chars at offset of a buffer. */
+Piece pieceCreate(PieceTable *pt, size_t offset, size_t length, WhichBuffer which) {
+  Piece piece = {
+    .offset = offset,
+    .length = length,
+    .which = which,
+  };
+  Buffer *buf = pieceBuffer(pt, &piece);
+  piece.newlines = bufferNewlineAt(buf, offset + length) - bufferNewlineAt(buf, offset);
+  TextMetrics metrics = bufferMetrics(buf, offset, length);
+  piece.codepoints = metrics.codepoints;
+  piece.width = metrics.width;
+  return piece;
+}
+
+/* Adds the newlines and metrics of other to piece. */
+void pieceAddCounts(Piece *piece, const Piece *other) {
+  piece->newlines += other->newlines;
+  piece->codepoints += other->codepoints;
+  piece->width += other->width;
+}
+
+/* Takes the newlines and metrics of other from piece. */
+void pieceSubtractCounts(Piece *piece, const Piece *other) {
+  piece->newlines -= other->newlines;
+  piece->codepoints -= other->codepoints;
+  piece->width -= other->width;
+}
+
+void slabInit(Slab *slab, size_t object_size) {
+  // keep objects aligned for the pointers and sizes they hold
+  slab->object_size = (object_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+  slab->blocks = NULL;
+  slab->free_list = NULL;
+}
+
+/* Returns an object from the free list, carving out a new block when it is empty. */
+void *slabAlloc(Slab *slab) {
+  if (slab->free_list == NULL) {
+    SlabBlock *block = malloc(sizeof(SlabBlock) + SLAB_BLOCK_OBJECTS * slab->object_size);
+    block->next = slab->blocks;
+    slab->blocks = block;
+    char *objects = (char *) (block + 1);
+    for (int i = SLAB_BLOCK_OBJECTS - 1; i >= 0; i--) {
+      SlabObject *object = (SlabObject *) &objects[i * slab->object_size];
+      object->next = slab->free_list;
+      slab->free_list = object;
     }
-  } else {
-    if (dest->boundary) {
-      src->first->prev->next = src->last->next;
-      src->last->next->prev  = src->first->prev;
+  }
+  SlabObject *object = slab->free_list;
+  slab->free_list = object->next;
+  return object;
+}
+
+/* Puts an object back on the free list. */
+void slabRelease(Slab *slab, void *ptr) {
+  SlabObject *object = ptr;
+  object->next = slab->free_list;
+  slab->free_list = object;
+}
+
+/* Frees every block of the slab, including objects still in use. */
+void slabFree(Slab *slab) {
+  while (slab->blocks) {
+    SlabBlock *block = slab->blocks;
+    slab->blocks = block->next;
+    free(block);
+  }
+  slab->free_list = NULL;
+}
+
+PieceNode *nodeCreate(PieceTable *pt, bool leaf) {
+  PieceNode *node = slabAlloc(leaf ? &pt->leaves : &pt->inners);
+  memset(node, 0, sizeof(PieceNode));
+  node->leaf = leaf;
+  node->refs = 1;
+  return node;
+}
+
+void nodeRelease(PieceTable *pt, PieceNode *node) {
+  slabRelease(node->leaf ? &pt->leaves : &pt->inners, node);
+}
+
+/* Drops a reference to node, releasing it and dropping its children when
+ * it was the last one. */
+void nodeDrop(PieceTable *pt, PieceNode *node) {
+  if (--node->refs > 0) return;
+  if (!node->leaf) {
+    for (unsigned i = 0; i < node->count; i++) nodeDrop(pt, INNER(node)->children[i]);
+  }
+  nodeRelease(pt, node);
+}
+
+/* Returns node if nothing else refers to it, otherwise a copy of it that
+ * shares its children. */
+PieceNode *nodeUnshare(PieceTable *pt, PieceNode *node) {
+  if (node->refs == 1) return node;
+  PieceNode *copy = nodeCreate(pt, node->leaf);
+  memcpy(copy, node, node->leaf ? sizeof(PieceLeaf) : sizeof(PieceInner));
+  copy->refs = 1;
+  if (!node->leaf) {
+    for (unsigned i = 0; i < node->count; i++) INNER(node)->children[i]->refs++;
+  }
+  node->refs--;
+  return copy;
+}
+
+/* Recomputes the totals of a node from its entries. */
+void nodeRecount(PieceNode *node) {
+  size_t length = 0, newlines = 0, codepoints = 0, width = 0;
+  for (unsigned i = 0; i < node->count; i++) {
+    if (node->leaf) {
+      length += LEAF(node)->pieces[i].length;
+      newlines += LEAF(node)->pieces[i].newlines;
+      codepoints += LEAF(node)->pieces[i].codepoints;
+      width += LEAF(node)->pieces[i].width;
     } else {
-      src->first->prev->next = dest->first;
-      src->last->next->prev  = dest->last;
-      dest->first->prev = src->first->prev;
-      dest->last->next = src->last->next;
+      length += INNER(node)->lengths[i];
+      newlines += INNER(node)->newlines[i];
+      codepoints += INNER(node)->codepoints[i];
+      width += INNER(node)->widths[i];
     }
   }
+  node->length = length;
+  node->newlines = newlines;
+  node->codepoints = codepoints;
+  node->width = width;
 }
 
-void rangeSwapBack(PieceTable *pt, PieceRange *pr) {
-  if (pr->boundary) {
-    // This PieceRange has two elements first and last which refer to Pieces
-    // on either side of what used to be a boundary. The boundary had stuff
-    // inserted into it, meaning pr->first->next refers to a Piece inserted
-    // in the boundary currently in the PieceTable.
-
-    // here we get the first and last Pieces inserted into the boundary.
-    Piece *first = pr->first->next;
-    Piece *last = pr->last->prev;
-
-    // we recreate the boundary
-    pr->first->next = pr->last;
-    pr->last->prev = pr->first;
-
-    // here we store what was initially inserted
-    // this PieceRange is in the opposite stack
-    pr->first = first;
-    pr->last = last;
-    pr->boundary = false;
+/* Copies n entries of src starting at from into dst at to. The nodes may be the same. */
+void nodeCopy(PieceNode *dst, unsigned to, PieceNode *src, unsigned from, unsigned n) {
+  if (dst->leaf) {
+    memmove(&LEAF(dst)->pieces[to], &LEAF(src)->pieces[from], n * sizeof(Piece));
   } else {
-    // get Pieces from PieceTable that surrounded pr
-    Piece *first = pr->first->prev;
-    Piece *last = pr->last->next;
-
-    // check for boundary case
-    if (first->next == last) {
-      // relink current PieceRange
-      first->next = pr->first;
-      last->prev = pr->last;
-
-      // store this PieceRange as boundary
-      pr->first = first;
-      pr->last = last;
-      pr->boundary = true;
+    memmove(&INNER(dst)->lengths[to], &INNER(src)->lengths[from], n * sizeof(size_t));
+    memmove(&INNER(dst)->newlines[to], &INNER(src)->newlines[from], n * sizeof(size_t));
+    memmove(&INNER(dst)->codepoints[to], &INNER(src)->codepoints[from], n * sizeof(size_t));
+    memmove(&INNER(dst)->widths[to], &INNER(src)->widths[from], n * sizeof(size_t));
+    memmove(&INNER(dst)->children[to], &INNER(src)->children[from], n * sizeof(PieceNode *));
+  }
+}
+
+/* Moves the upper half of a full node into a new sibling and returns it. */
+PieceNode *nodeSplit(PieceTable *pt, PieceNode *node) {
+  PieceNode *sibling = nodeCreate(pt, node->leaf);
+  unsigned keep = node->count / 2;
+  nodeCopy(sibling, 0, node, keep, node->count - keep);
+  sibling->count = node->count - keep;
+  node->count = keep;
+  nodeRecount(node);
+  nodeRecount(sibling);
+  return sibling;
+}
+
+/* Makes room for an entry at pos, splitting the node if it is full.
+ * Returns the node that now owns pos and updates pos and sibling. */
+PieceNode *nodeOpen(PieceTable *pt, PieceNode *node, unsigned *pos, PieceNode **sibling) {
+  *sibling = NULL;
+  if (node->count == PT_NODE_CAPACITY) {
+    *sibling = nodeSplit(pt, node);
+    if (*pos > node->count) {
+      *pos -= node->count;
+      node = *sibling;
+    }
+  }
+  nodeCopy(node, *pos + 1, node, *pos, node->count - *pos);
+  node->count++;
+  return node;
+}
+
+void innerSetChild(PieceInner *inner, unsigned pos, PieceNode *child) {
+  inner->children[pos] = child;
+  inner->lengths[pos] = child->length;
+  inner->newlines[pos] = child->newlines;
+  inner->codepoints[pos] = child->codepoints;
+  inner->widths[pos] = child->width;
+}
+
+/* Makes the child at pos of inner safe to change and returns it. */
+PieceNode *innerUnshare(PieceTable *pt, PieceInner *inner, unsigned pos) {
+  inner->children[pos] = nodeUnshare(pt, inner->children[pos]);
+  return inner->children[pos];
+}
+
+/* Merges the children at pos and pos + 1 of inner when they fit into one
+ * node, otherwise spreads their entries evenly between them. */
+void innerJoin(PieceTable *pt, PieceInner *inner, unsigned pos) {
+  PieceNode *left = innerUnshare(pt, inner, pos);
+  PieceNode *right = innerUnshare(pt, inner, pos + 1);
+  unsigned total = left->count + right->count;
+  if (total <= PT_NODE_CAPACITY) {
+    nodeCopy(left, left->count, right, 0, right->count);
+    left->count = total;
+    nodeRecount(left);
+    nodeRelease(pt, right);
+    nodeCopy(&inner->node, pos + 1, &inner->node, pos + 2, inner->node.count - pos - 2);
+    inner->node.count--;
+    innerSetChild(inner, pos, left);
+    return;
+  }
+  unsigned half = total / 2;
+  if (left->count < half) {
+    unsigned n = half - left->count;
+    nodeCopy(left, left->count, right, 0, n);
+    nodeCopy(right, 0, right, n, right->count - n);
+    left->count += n;
+    right->count -= n;
+  } else {
+    unsigned n = left->count - half;
+    nodeCopy(right, n, right, 0, right->count);
+    nodeCopy(right, 0, left, half, n);
+    left->count -= n;
+    right->count += n;
+  }
+  nodeRecount(left);
+  nodeRecount(right);
+  innerSetChild(inner, pos, left);
+  innerSetChild(inner, pos + 1, right);
+}
+
+/* Finds the piece containing index starting from the last cursor used, which
+ * is cheap when index is in the same leaf. Returns false if it is not. */
+bool treeSeekNear(PieceTable *pt, size_t index, PieceCursor *cur) {
+  *cur = pt->hint;
+  PieceLeaf *leaf = LEAF(cur->nodes[cur->depth]);
+  unsigned i = cur->slots[cur->depth];
+  while (index < cur->start) {
+    if (i == 0) return false;
+    i--;
+    cur->start -= leaf->pieces[i].length;
+    cur->newlines -= leaf->pieces[i].newlines;
+    traceCount(pt, pieces_walked);
+  }
+  while (i < leaf->node.count && index >= cur->start + leaf->pieces[i].length) {
+    cur->start += leaf->pieces[i].length;
+    cur->newlines += leaf->pieces[i++].newlines;
+    traceCount(pt, pieces_walked);
+  }
+  // past the end of the leaf is only a position at the end of the sequence
+  if (i == leaf->node.count && cur->start < pt->sequence_length) return false;
+  cur->slots[cur->depth] = i;
+  return true;
+}
+
+/* Finds the piece containing index. At the end of the sequence the cursor
+ * points one past the last piece. */
+void treeSeek(PieceTable *pt, size_t index, PieceCursor *cur) {
+  traceCount(pt, seeks);
+  if (pt->hint_valid && pt->seek_hint && treeSeekNear(pt, index, cur)) {
+    traceCount(pt, hint_seeks);
+    pt->hint = *cur;
+    return;
+  }
+  PieceNode *node = pt->root;
+  size_t start = 0, newlines = 0;
+  unsigned depth = 0;
+  while (!node->leaf) {
+    PieceInner *inner = INNER(node);
+    unsigned i = 0;
+    while (i + 1 < node->count && index >= start + inner->lengths[i]) {
+      start += inner->lengths[i];
+      newlines += inner->newlines[i++];
+    }
+    cur->nodes[depth] = node;
+    cur->slots[depth++] = i;
+    node = inner->children[i];
+  }
+  unsigned i = 0;
+  while (i < node->count && index >= start + LEAF(node)->pieces[i].length) {
+    start += LEAF(node)->pieces[i].length;
+    newlines += LEAF(node)->pieces[i++].newlines;
+    traceCount(pt, pieces_walked);
+  }
+  cur->nodes[depth] = node;
+  cur->slots[depth] = i;
+  cur->depth = depth;
+  cur->start = start;
+  cur->newlines = newlines;
+  pt->hint = *cur;
+  pt->hint_valid = true;
+}
+
+/* Finds the piece containing the line-th newline of the sequence, counting
+ * from 1. */
+void treeSeekNewline(PieceTable *pt, size_t line, PieceCursor *cur) {
+  PieceNode *node = pt->root;
+  size_t start = 0, newlines = 0;
+  unsigned depth = 0;
+  while (!node->leaf) {
+    PieceInner *inner = INNER(node);
+    unsigned i = 0;
+    while (i + 1 < node->count && line > newlines + inner->newlines[i]) {
+      start += inner->lengths[i];
+      newlines += inner->newlines[i++];
+    }
+    cur->nodes[depth] = node;
+    cur->slots[depth++] = i;
+    node = inner->children[i];
+  }
+  unsigned i = 0;
+  while (i + 1 < node->count && line > newlines + LEAF(node)->pieces[i].newlines) {
+    start += LEAF(node)->pieces[i].length;
+    newlines += LEAF(node)->pieces[i++].newlines;
+  }
+  cur->nodes[depth] = node;
+  cur->slots[depth] = i;
+  cur->depth = depth;
+  cur->start = start;
+  cur->newlines = newlines;
+}
+
+Piece *cursorPiece(PieceCursor *cur) {
+  return &LEAF(cur->nodes[cur->depth])->pieces[cur->slots[cur->depth]];
+}
+
+bool cursorValid(PieceCursor *cur) {
+  return cur->slots[cur->depth] < cur->nodes[cur->depth]->count;
+}
+
+/* Moves the cursor to the next piece. Returns false when there is none, with
+ * the cursor left one past the last piece. */
+bool cursorNext(PieceCursor *cur) {
+  unsigned d = cur->depth;
+  cur->start += cursorPiece(cur)->length;
+  cur->newlines += cursorPiece(cur)->newlines;
+  while (d > 0 && cur->slots[d] + 1 >= cur->nodes[d]->count) d--;
+  if (cur->slots[d] + 1 >= cur->nodes[d]->count) {
+    cur->slots[cur->depth] = cur->nodes[cur->depth]->count;
+    return false;
+  }
+  cur->slots[d]++;
+  for (; d < cur->depth; d++) {
+    cur->nodes[d + 1] = INNER(cur->nodes[d])->children[cur->slots[d]];
+    cur->slots[d + 1] = 0;
+  }
+  return true;
+}
+
+/* Moves the cursor to the previous piece. Returns false when there is none. */
+bool cursorPrev(PieceCursor *cur) {
+  unsigned d = cur->depth;
+  while (d > 0 && cur->slots[d] == 0) d--;
+  if (cur->slots[d] == 0) return false;
+  cur->slots[d]--;
+  for (; d < cur->depth; d++) {
+    cur->nodes[d + 1] = INNER(cur->nodes[d])->children[cur->slots[d]];
+    cur->slots[d + 1] = cur->nodes[d + 1]->count - 1;
+  }
+  cur->start -= cursorPiece(cur)->length;
+  cur->newlines -= cursorPiece(cur)->newlines;
+  return true;
+}
+
+/* Reclaims the nodes of the snapshots released since the last call. This
+ * runs on the thread editing the table, so the node references are only
+ * ever changed by that thread. */
+void snapshotReclaim(PieceTable *pt) {
+  if (__atomic_load_n(&pt->retired, __ATOMIC_RELAXED) == NULL) return;
+  PieceTable *snapshot = __atomic_exchange_n(&pt->retired, NULL, __ATOMIC_ACQUIRE);
+  while (snapshot) {
+    PieceTable *next = snapshot->next;
+    nodeDrop(pt, snapshot->root);
+    free(snapshot->add.segments.elems);
+    free(snapshot->add.newlines.elems);
+    free(snapshot->add.samples.elems);
+    free(snapshot);
+    pt->snapshots--;
+    snapshot = next;
+  }
+}
+
+/* Copies the nodes on the path of cur that are shared with snapshots, so
+ * that the path can be changed. */
+void cursorUnshare(PieceTable *pt, PieceCursor *cur) {
+  assert(pt->source == NULL);
+  snapshotReclaim(pt);
+  if (pt->root->refs > 1) {
+    pt->root = nodeUnshare(pt, pt->root);
+    cur->nodes[0] = pt->root;
+    pt->hint_valid = false;
+  }
+  for (unsigned d = 0; d < cur->depth; d++) {
+    PieceNode *child = innerUnshare(pt, INNER(cur->nodes[d]), cur->slots[d]);
+    if (child != cur->nodes[d + 1]) {
+      cur->nodes[d + 1] = child;
+      pt->hint_valid = false;
+    }
+  }
+}
+
+/* Finds the piece containing index like treeSeek, with the path to it made
+ * safe to change. */
+void treeSeekWrite(PieceTable *pt, size_t index, PieceCursor *cur) {
+  treeSeek(pt, index, cur);
+  cursorUnshare(pt, cur);
+}
+
+/* Propagates a change in the leaf at cur up to the root. sibling is the new
+ * right half of the leaf if it was split. */
+void treeUpdate(PieceTable *pt, PieceCursor *cur, PieceNode *sibling) {
+  PieceNode *split = sibling;
+  nodeRecount(cur->nodes[cur->depth]);
+  for (int d = (int) cur->depth - 1; d >= 0; d--) {
+    PieceInner *parent = INNER(cur->nodes[d]);
+    unsigned pos = cur->slots[d];
+    innerSetChild(parent, pos, parent->children[pos]);
+    if (sibling) {
+      PieceNode *child = sibling;
+      pos++;
+      PieceNode *node = nodeOpen(pt, &parent->node, &pos, &sibling);
+      innerSetChild(INNER(node), pos, child);
+      nodeRecount(node);
     } else {
-      // replacing non-boundary with non-boundary
-      // get first and last Pieces that replaced pr
-      first = first->next;
-      last = last->prev;
+      nodeRecount(&parent->node);
+    }
+  }
+  if (sibling) {
+    // the root was split, so the tree grows a level
+    PieceNode *root = nodeCreate(pt, false);
+    innerSetChild(INNER(root), 0, pt->root);
+    innerSetChild(INNER(root), 1, sibling);
+    root->count = 2;
+    nodeRecount(root);
+    pt->root = root;
+  }
+  pt->sequence_length = pt->root->length;
+  // the cursor still points at the changed piece unless the leaf was split
+  pt->hint = *cur;
+  pt->hint_valid = split == NULL;
+}
 
-      // relink pr back into the PieceTable
-      first->prev->next = pr->first;
-      last->next->prev = pr->last;
-      /* first->next = pr->first; */
-      /* last->prev = pr->last; */
+/* Propagates a shrinking change in the leaf at cur up to the root, joining
+ * nodes that became too small. */
+void treeRebalance(PieceTable *pt, PieceCursor *cur) {
+  bool joined = false;
+  nodeRecount(cur->nodes[cur->depth]);
+  for (int d = (int) cur->depth - 1; d >= 0; d--) {
+    PieceInner *parent = INNER(cur->nodes[d]);
+    unsigned pos = cur->slots[d];
+    PieceNode *child = parent->children[pos];
+    if (child->count < PT_NODE_MIN) {
+      innerJoin(pt, parent, pos > 0 ? pos - 1 : pos);
+      joined = true;
+    } else {
+      innerSetChild(parent, pos, child);
+    }
+    nodeRecount(&parent->node);
+  }
+  while (!pt->root->leaf && pt->root->count == 1) {
+    // the root has a single child, so the tree shrinks a level
+    PieceNode *root = pt->root;
+    pt->root = INNER(root)->children[0];
+    nodeRelease(pt, root);
+  }
+  pt->sequence_length = pt->root->length;
+  // the cursor still points at the changed piece unless nodes were joined
+  pt->hint = *cur;
+  pt->hint_valid = !joined;
+}
+
+/* Inserts piece before the piece at cur. */
+void treeInsertAt(PieceTable *pt, PieceCursor *cur, Piece piece) {
+  PieceNode *sibling;
+  unsigned pos = cur->slots[cur->depth];
+  PieceNode *leaf = nodeOpen(pt, cur->nodes[cur->depth], &pos, &sibling);
+  LEAF(leaf)->pieces[pos] = piece;
+  nodeRecount(leaf);
+  treeUpdate(pt, cur, sibling);
+}
+
+/* Removes the piece at cur. */
+void treeRemoveAt(PieceTable *pt, PieceCursor *cur) {
+  PieceNode *leaf = cur->nodes[cur->depth];
+  unsigned pos = cur->slots[cur->depth];
+  nodeCopy(leaf, pos, leaf, pos + 1, leaf->count - pos - 1);
+  leaf->count--;
+  treeRebalance(pt, cur);
+}
+
+/* Makes sure a piece starts at index by splitting the piece containing it. */
+void treeSplit(PieceTable *pt, size_t index) {
+  PieceCursor cur;
+  treeSeekWrite(pt, index, &cur);
+  if (cur.start == index) return;
+  traceCount(pt, piece_splits);
+  Piece *piece = cursorPiece(&cur);
+  size_t in_piece_offset = index - cur.start;
+  Piece right = pieceCreate(pt, piece->offset + in_piece_offset,
+                            piece->length - in_piece_offset, piece->which);
+  piece->length = in_piece_offset;
+  pieceSubtractCounts(piece, &right);
+  cur.slots[cur.depth]++;
+  cur.start = index;
+  cur.newlines += piece->newlines;
+  treeInsertAt(pt, &cur, right);
+}
 
-      // store this PieceRange
-      pr->first = first;
-      pr->last = last;
-      /* pr->first = first->next; */
-      /* pr->last = last->prev; */
-      pr->boundary = false;
+/* Inserts piece at index of the sequence. */
+void treeInsert(PieceTable *pt, size_t index, Piece piece) {
+  PieceCursor cur;
+  treeSplit(pt, index);
+  treeSeekWrite(pt, index, &cur);
+  treeInsertAt(pt, &cur, piece);
+}
+
+/* Removes length chars at index from the sequence and appends the pieces
+ * that referred to them to removed. */
+void treeRemove(PieceTable *pt, size_t index, size_t length, Pieces *removed) {
+  while (length > 0) {
+    PieceCursor cur;
+    treeSeekWrite(pt, index, &cur);
+    Piece *piece = cursorPiece(&cur);
+    size_t in_piece_offset = index - cur.start;
+    size_t taken = minSize(piece->length - in_piece_offset, length);
+    Piece removedPiece = pieceCreate(pt, piece->offset + in_piece_offset, taken, piece->which);
+    listAppend(removed, removedPiece);
+    length -= taken;
+
+    if (taken == piece->length) {
+      treeRemoveAt(pt, &cur);
+    } else if (in_piece_offset == 0) {
+      // remove the start of the piece
+      piece->offset += taken;
+      piece->length -= taken;
+      pieceSubtractCounts(piece, &removedPiece);
+      treeRebalance(pt, &cur);
+    } else if (in_piece_offset + taken == piece->length) {
+      // remove the end of the piece
+      piece->length -= taken;
+      pieceSubtractCounts(piece, &removedPiece);
+      treeRebalance(pt, &cur);
+    } else {
+      // remove the middle of the piece, so keep the start and add the end
+      traceCount(pt, piece_splits);
+      Piece right = pieceCreate(pt, removedPiece.offset + taken,
+                                piece->length - in_piece_offset - taken, piece->which);
+      piece->length = in_piece_offset;
+      pieceSubtractCounts(piece, &removedPiece);
+      pieceSubtractCounts(piece, &right);
+      cur.slots[cur.depth]++;
+      cur.start = index;
+      cur.newlines += piece->newlines;
+      treeInsertAt(pt, &cur, right);
     }
   }
+}
 
-  // restore sequence length and save current sequence length
-  size_t new_sequence_length = pr->sequence_length;
-  pr->sequence_length = pt->sequence_length;
-  pt->sequence_length = new_sequence_length;
+/* Joins the pieces on either side of index if they are contiguous in the
+ * same buffer. Returns whether they were. */
+bool treeJoin(PieceTable *pt, size_t index) {
+  if (index == 0 || index >= pt->sequence_length) return false;
+  PieceCursor cur;
+  treeSeek(pt, index, &cur);
+  if (cur.start != index) return false;
+  Piece right = *cursorPiece(&cur);
+  treeSeek(pt, index - 1, &cur);
+  Piece *left = cursorPiece(&cur);
+  if (left->which != right.which || left->offset + left->length != right.offset) return false;
+  traceCount(pt, piece_joins);
+  treeSeekWrite(pt, index, &cur);
+  treeRemoveAt(pt, &cur);
+  treeSeekWrite(pt, index - 1, &cur);
+  cursorPiece(&cur)->length += right.length;
+  pieceAddCounts(cursorPiece(&cur), &right);
+  treeUpdate(pt, &cur, NULL);
+  return true;
 }
 
-PieceTable *ptCreate(const char *original_buffer, size_t buffer_length) {
+/* Extends the Add piece ending at index by length chars, if it ends at
+ * add_offset in the add buffer. */
+bool treeExtend(PieceTable *pt, size_t index, size_t add_offset, size_t length) {
+  if (index == 0) return false;
+  PieceCursor cur;
+  treeSeekWrite(pt, index - 1, &cur);
+  Piece *piece = cursorPiece(&cur);
+  if (piece->which != Add || piece->offset + piece->length != add_offset ||
+      cur.start + piece->length != index) {
+    return false;
+  }
+  Piece added = pieceCreate(pt, add_offset, length, Add);
+  piece->length += length;
+  pieceAddCounts(piece, &added);
+  treeUpdate(pt, &cur, NULL);
+  return true;
+}
+
+PieceRange *rangeCreate(PieceTable *pt, size_t index, size_t span, Pieces pieces) {
+  PieceRange *pr = slabAlloc(&pt->ranges);
+  pr->index = index;
+  pr->span = span;
+  pr->pieces = pieces;
+  pr->group = 0;
+  return pr;
+}
+
+void rangeRelease(PieceTable *pt, PieceRange *pr) {
+  free(pr->pieces.elems);
+  slabRelease(&pt->ranges, pr);
+}
+
+/* Returns the add buffer text referred to by the pieces of a record. */
+size_t rangeTextBytes(PieceRange *pr) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < pr->pieces.size; i++) {
+    if (pr->pieces.elems[i].which == Add) bytes += pr->pieces.elems[i].length;
+  }
+  return bytes;
+}
+
+/* Returns the memory a record holds on to: itself, its pieces and the add
+ * buffer text they refer to. */
+size_t rangeBytes(PieceRange *pr) {
+  return sizeof(PieceRange) + pr->pieces.capacity * sizeof(Piece) + rangeTextBytes(pr);
+}
+
+/* Pushes a new record on the undo stack. */
+void rangePush(PieceTable *pt, PieceRange *pr) {
+  pt->history_bytes += rangeBytes(pr);
+  listAppend(&pt->undo_stack, pr);
+}
+
+/* Releases the records of a stack along with the pieces they pin. */
+void rangeStackClear(PieceTable *pt, RangeStack *stack) {
+  for (size_t i = 0; i < stack->size; i++) {
+    pt->history_bytes -= rangeBytes(stack->elems[i]);
+    rangeRelease(pt, stack->elems[i]);
+  }
+  listClear(stack);
+}
+
+/* Returns whether the history holds more than records undo records or
+ * bytes of memory, where 0 is no limit. */
+bool historyOver(PieceTable *pt, size_t records, size_t bytes) {
+  return (records > 0 && pt->undo_stack.size > records) ||
+         (bytes > 0 && pt->history_bytes > bytes);
+}
+
+/* Drops the records at the bottom of stack, a step at a time and no
+ * further than limit, while it holds more than records records or the
+ * history more than bytes, where 0 is no limit. */
+void rangeStackTrim(PieceTable *pt, RangeStack *stack, size_t limit, size_t records, size_t bytes) {
+  size_t dropped = 0;
+  while (dropped < limit &&
+         ((records > 0 && stack->size - dropped > records) || (bytes > 0 && pt->history_bytes > bytes))) {
+    size_t group = stack->elems[dropped]->group;
+    do {
+      pt->history_bytes -= rangeBytes(stack->elems[dropped]);
+      rangeRelease(pt, stack->elems[dropped++]);
+    } while (group != 0 && dropped < limit && stack->elems[dropped]->group == group);
+  }
+  if (dropped == 0) return;
+  memmove(stack->elems, &stack->elems[dropped], (stack->size - dropped) * sizeof(PieceRange *));
+  stack->size -= dropped;
+  pt->undo_dropped += dropped;
+}
+
+/* Drops the oldest undo steps while the history is over its budget, always
+ * keeping the newest step, and then the furthest redo steps while the
+ * records of both stacks still take too much memory. The add buffer text
+ * only they referred to is freed by the next ptCompact that collects. */
+void historyTrim(PieceTable *pt) {
+  if (!historyOver(pt, pt->undo_limit, pt->undo_byte_limit)) return;
+  // go an eighth under the budget so that not every edit has to trim
+  size_t records = pt->undo_limit - pt->undo_limit / 8;
+  size_t bytes = pt->undo_byte_limit - pt->undo_byte_limit / 8;
+
+  RangeStack *stack = &pt->undo_stack;
+  if (stack->size > 0) {
+    // the newest step may be a group of records
+    size_t newest = stack->size - 1;
+    while (newest > 0 && stack->elems[newest]->group != 0 &&
+           stack->elems[newest - 1]->group == stack->elems[newest]->group) {
+      newest--;
+    }
+    rangeStackTrim(pt, stack, newest, records, bytes);
+  }
+  // the bottom of the redo stack is the step furthest from being redone
+  rangeStackTrim(pt, &pt->redo_stack, pt->redo_stack.size, 0, bytes);
+}
+
+/* Swaps the pieces stored in pr with the text they were replaced by. */
+void rangeSwapBack(PieceTable *pt, PieceRange *pr) {
+  // take out what currently occupies the range
+  Pieces current = {0};
+  treeRemove(pt, pr->index, pr->span, &current);
+
+  // put back the stored pieces
+  size_t index = pr->index;
+  for (size_t i = 0; i < pr->pieces.size; i++) {
+    treeInsert(pt, index, pr->pieces.elems[i]);
+    index += pr->pieces.elems[i].length;
+  }
+  // undo the splits made when the range was first swapped out
+  treeJoin(pt, index);
+  treeJoin(pt, pr->index);
+
+  // and store what was taken out in the opposite stack
+  pt->history_bytes -= rangeBytes(pr);
+  free(pr->pieces.elems);
+  pr->pieces = current;
+  pr->span = index - pr->index;
+  pt->history_bytes += rangeBytes(pr);
+}
+
+/* Creates a piece table with empty buffers and sequence. */
+PieceTable *tableCreate(void) {
   PieceTable *pt = calloc(1, sizeof(PieceTable));
-  pt->original.elems = (char *) original_buffer;
-  pt->original.size = buffer_length;
-  pt->original.capacity = buffer_length;
-  pt->head = calloc(1, sizeof(Piece));
-  pt->tail = calloc(1, sizeof(Piece));
-  pt->head->next = pt->tail;
-  pt->tail->prev = pt->head;
+  slabInit(&pt->leaves, sizeof(PieceLeaf));
+  slabInit(&pt->inners, sizeof(PieceInner));
+  slabInit(&pt->ranges, sizeof(PieceRange));
+  pt->root = nodeCreate(pt, true);
+  pt->seek_hint = true;
+  pt->last_action = Nop;
+  if (PT_TRACE) pt->trace = calloc(1, sizeof(TraceRing));
+  return pt;
+}
+
+/* Creates a piece table over original_buffer. The buffer is not copied or
+ * freed, so it must outlive the piece table. */
+PieceTable *ptCreate(const char *original_buffer, size_t buffer_length) {
+  PieceTable *pt = tableCreate();
+  bufferBorrow(&pt->original, original_buffer, buffer_length);
   // add piece for original buffer
-  PieceRange oldPR = {
-    .first = pt->head,
-    .last = pt->tail,
-    .boundary = true,
-  };
-  Piece *newPiece = pieceCreate(0, buffer_length, Original);
-  PieceRange newPR = {
-    .first = newPiece,
-    .last = newPiece,
-    .boundary = false,
-  };
-  // and place it in the piece table
-  rangeSwap(&oldPR, &newPR);
-  pt->sequence_length = buffer_length;
+  if (buffer_length > 0) {
+    treeInsert(pt, 0, pieceCreate(pt, 0, buffer_length, Original));
+  }
   return pt;
 }
 
+/* Maps the file at path read-only and stats it. The mapping is NULL for an
+ * empty file. Returns false on failure. */
+bool fileMap(const char *path, char **chars, struct stat *st) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+  if (fstat(fd, st) == -1) {
+    close(fd);
+    return false;
+  }
+  *chars = NULL;
+  if (st->st_size > 0) {
+    *chars = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*chars == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+  }
+  // the mapping stays valid after the file is closed
+  close(fd);
+  return true;
+}
+
+/* Creates a piece table over the contents of the file at path, which is
+ * mapped read-only instead of read into memory. Returns NULL on failure. */
+PieceTable *ptCreateFromFile(const char *path) {
+  char *original;
+  struct stat st;
+  if (!fileMap(path, &original, &st)) return NULL;
+  size_t length = st.st_size;
+
+  // the newline index is built with one pass over the file,
+  // after which edits jump around in it
+  if (length > 0) posix_madvise(original, length, POSIX_MADV_SEQUENTIAL);
+  PieceTable *pt = ptCreate(original, length);
+  if (length > 0) posix_madvise(original, length, POSIX_MADV_RANDOM);
+  if (length > 0) pt->original.segments.elems[0].kind = Mapped;
+  return pt;
+}
+
+/* Takes a read-only view of the current text of pt, which can be read with
+ * the functions that read a table while pt is edited, from any thread. A
+ * snapshot shares the nodes of pt that have not changed since, and must be
+ * released before pt is freed. Like a table, a snapshot must only be used
+ * by one thread at a time. */
+PieceTable *ptSnapshot(PieceTable *pt) {
+  assert(pt->source == NULL);
+  snapshotReclaim(pt);
+  PieceTable *snapshot = calloc(1, sizeof(PieceTable));
+  snapshot->source = pt;
+  snapshot->root = pt->root;
+  pt->root->refs++;
+  snapshot->seek_hint = true;
+  snapshot->last_action = Nop;
+  snapshot->sequence_length = pt->sequence_length;
+  // the original buffer never changes, but appending to the add buffer
+  // grows the lists of its segments, newlines and samples, so those are
+  // copied
+  snapshot->original = pt->original;
+  snapshot->add.size = pt->add.size;
+  if (pt->add.segments.size > 0) {
+    listExtend(&snapshot->add.segments, pt->add.segments.elems, pt->add.segments.size);
+  }
+  if (pt->add.newlines.size > 0) {
+    listExtend(&snapshot->add.newlines, pt->add.newlines.elems, pt->add.newlines.size);
+  }
+  if (pt->add.samples.size > 0) {
+    listExtend(&snapshot->add.samples, pt->add.samples.elems, pt->add.samples.size);
+  }
+  pt->snapshots++;
+  return snapshot;
+}
+
+/* Releases a snapshot. This can be called from any thread, and the nodes
+ * only kept by the snapshot are reclaimed by the next edit of its table. */
+void ptRelease(PieceTable *snapshot) {
+  PieceTable *pt = snapshot->source;
+  snapshot->next = __atomic_load_n(&pt->retired, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&pt->retired, &snapshot->next, snapshot, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+}
+
 void ptFree(PieceTable *pt) {
-  if (pt->add.capacity > 0) free(pt->add.elems);
-  free(pt->original.elems);
-  for (Piece *p = pt->head->next; p; p = p->next) free(p->prev);
-  free(pt->tail);
+  assert(pt->source == NULL);
+  snapshotReclaim(pt);
+  assert(pt->snapshots == 0);
+  bufferFree(&pt->original);
+  bufferFree(&pt->add);
+  rangeStackClear(pt, &pt->undo_stack);
+  rangeStackClear(pt, &pt->redo_stack);
+  slabFree(&pt->leaves);
+  slabFree(&pt->inners);
+  slabFree(&pt->ranges);
+  free(pt->undo_stack.elems);
+  free(pt->redo_stack.elems);
+  if (pt->session) munmap(pt->session, pt->session_length);
+  free(pt->trace);
   free(pt);
 }
 
+// Session files hold the state of a table so that it can be reopened with
+// its undo history. All numbers are 64-bit in native byte order, so a
+// session is only meant to be reopened on the machine that saved it:
+//
+//   "OLIKSESS" version
+//   original file: path length, path, size, mtime seconds, mtime nanoseconds, hash
+//   original newlines: count, offsets
+//   original metrics: sample count, (codepoints, width) per sample, total
+//   add buffer: size, segment count, (offset, size, sample) per segment,
+//               newline count, offsets, metrics, chars of every segment
+//   last group
+//   pieces: count, (offset, length, newlines, codepoints, width, which) per piece
+//   undo and redo records: count, (index, span, group, pieces) per record
+//
+// The metrics are saved so that loading never has to count the text.
+// The original file is not copied. It is mapped again when the session is
+// loaded, and the add buffer chars are used from the mapped session file.
+#define SESSION_MAGIC "OLIKSESS"
+#define SESSION_VERSION 2
+
+/* Returns the FNV-1a hash of length chars. */
+uint64_t hashChars(const char *chars, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char) chars[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+void sessionWrite(FILE *fp, uint64_t value) {
+  fwrite(&value, sizeof(value), 1, fp);
+}
+
+void sessionWritePieces(FILE *fp, const Piece *pieces, size_t n) {
+  sessionWrite(fp, n);
+  for (size_t i = 0; i < n; i++) {
+    sessionWrite(fp, pieces[i].offset);
+    sessionWrite(fp, pieces[i].length);
+    sessionWrite(fp, pieces[i].newlines);
+    sessionWrite(fp, pieces[i].codepoints);
+    sessionWrite(fp, pieces[i].width);
+    sessionWrite(fp, pieces[i].which);
+  }
+}
+
+void sessionWriteMetrics(FILE *fp, Buffer *buf) {
+  sessionWrite(fp, buf->samples.size);
+  if (buf->samples.size > 0) fwrite(buf->samples.elems, sizeof(TextMetrics), buf->samples.size, fp);
+  sessionWrite(fp, buf->total.codepoints);
+  sessionWrite(fp, buf->total.width);
+}
+
+void sessionWriteRanges(FILE *fp, RangeStack *stack) {
+  sessionWrite(fp, stack->size);
+  for (size_t i = 0; i < stack->size; i++) {
+    PieceRange *pr = stack->elems[i];
+    sessionWrite(fp, pr->index);
+    sessionWrite(fp, pr->span);
+    sessionWrite(fp, pr->group);
+    sessionWritePieces(fp, pr->pieces.elems, pr->pieces.size);
+  }
+}
+
+/* Saves the state of pt, whose original buffer is the file at original_path,
+ * to a session file at path. The session is written to a temporary file
+ * first, so an existing one is only replaced once the new one is complete.
+ * Returns false on failure. */
+bool ptSaveSession(PieceTable *pt, const char *path, const char *original_path) {
+  assert(pt->source == NULL);
+  struct stat st;
+  if (stat(original_path, &st) == -1 || (size_t) st.st_size != pt->original.size) return false;
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL) return false;
+
+  fwrite(SESSION_MAGIC, 1, 8, fp);
+  sessionWrite(fp, SESSION_VERSION);
+  sessionWrite(fp, strlen(original_path));
+  fwrite(original_path, 1, strlen(original_path), fp);
+  sessionWrite(fp, pt->original.size);
+  sessionWrite(fp, st.st_mtim.tv_sec);
+  sessionWrite(fp, st.st_mtim.tv_nsec);
+  sessionWrite(fp, pt->original.size > 0 ? hashChars(pt->original.segments.elems[0].elems, pt->original.size) : 0);
+  sessionWrite(fp, pt->original.newlines.size);
+  if (pt->original.newlines.size > 0) {
+    fwrite(pt->original.newlines.elems, sizeof(size_t), pt->original.newlines.size, fp);
+  }
+  sessionWriteMetrics(fp, &pt->original);
+
+  Buffer *add = &pt->add;
+  sessionWrite(fp, add->size);
+  sessionWrite(fp, add->segments.size);
+  for (size_t i = 0; i < add->segments.size; i++) {
+    sessionWrite(fp, add->segments.elems[i].offset);
+    sessionWrite(fp, add->segments.elems[i].size);
+    sessionWrite(fp, add->segments.elems[i].sample);
+  }
+  sessionWrite(fp, add->newlines.size);
+  if (add->newlines.size > 0) fwrite(add->newlines.elems, sizeof(size_t), add->newlines.size, fp);
+  sessionWriteMetrics(fp, add);
+  for (size_t i = 0; i < add->segments.size; i++) {
+    // segments freed by a collecting ptCompact have no chars left
+    Segment *segment = &add->segments.elems[i];
+    if (segment->size > 0 && segment->elems != NULL) fwrite(segment->elems, 1, segment->size, fp);
+  }
+
+  sessionWrite(fp, pt->groups);
+  Pieces pieces = {0};
+  PieceCursor cur;
+  treeSeek(pt, 0, &cur);
+  while (cursorValid(&cur)) {
+    listAppend(&pieces, *cursorPiece(&cur));
+    cursorNext(&cur);
+  }
+  sessionWritePieces(fp, pieces.elems, pieces.size);
+  free(pieces.elems);
+  sessionWriteRanges(fp, &pt->undo_stack);
+  sessionWriteRanges(fp, &pt->redo_stack);
+
+  bool failed = ferror(fp);
+  if (fclose(fp) != 0 || failed || rename(tmp_path, path) == -1) {
+    remove(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+// Position in a mapped session file being loaded
+typedef struct {
+  const char *chars;
+  size_t length;
+  size_t pos;
+  bool failed; // set when reading past the end
+} SessionReader;
+
+/* Returns a pointer to the next length chars of the session. */
+const char *sessionRead(SessionReader *reader, size_t length) {
+  if (reader->failed || length > reader->length - reader->pos) {
+    reader->failed = true;
+    return NULL;
+  }
+  const char *chars = &reader->chars[reader->pos];
+  reader->pos += length;
+  return chars;
+}
+
+uint64_t sessionReadValue(SessionReader *reader) {
+  uint64_t value = 0;
+  const char *chars = sessionRead(reader, sizeof(value));
+  if (chars) memcpy(&value, chars, sizeof(value));
+  return value;
+}
+
+/* Reads a list of offsets into offsets. */
+void sessionReadOffsets(SessionReader *reader, Offsets *offsets) {
+  size_t n = sessionReadValue(reader);
+  const char *chars = sessionRead(reader, n > SIZE_MAX / sizeof(size_t) ? SIZE_MAX : n * sizeof(size_t));
+  if (chars && n > 0) listExtend(offsets, chars, n);
+}
+
+/* Reads the metrics samples and totals of buf, checking that every segment
+ * has its samples. */
+void sessionReadMetrics(SessionReader *reader, Buffer *buf) {
+  size_t n = sessionReadValue(reader);
+  const char *chars = sessionRead(reader, n > SIZE_MAX / sizeof(TextMetrics) ? SIZE_MAX : n * sizeof(TextMetrics));
+  if (chars && n > 0) listExtend(&buf->samples, chars, n);
+  buf->total.codepoints = sessionReadValue(reader);
+  buf->total.width = sessionReadValue(reader);
+  for (size_t i = 0; i < buf->segments.size && !reader->failed; i++) {
+    Segment *segment = &buf->segments.elems[i];
+    if (segment->sample >= buf->samples.size ||
+        segment->size / PT_METRICS_BLOCK >= buf->samples.size - segment->sample) {
+      reader->failed = true;
+    }
+  }
+}
+
+/* Reads a list of pieces into pieces, checking that they are inside their
+ * buffers. */
+void sessionReadPieces(SessionReader *reader, PieceTable *pt, Pieces *pieces) {
+  size_t n = sessionReadValue(reader);
+  for (size_t i = 0; i < n && !reader->failed; i++) {
+    Piece piece;
+    piece.offset = sessionReadValue(reader);
+    piece.length = sessionReadValue(reader);
+    piece.newlines = sessionReadValue(reader);
+    piece.codepoints = sessionReadValue(reader);
+    piece.width = sessionReadValue(reader);
+    piece.which = sessionReadValue(reader) == Add ? Add : Original;
+    Buffer *buf = pieceBuffer(pt, &piece);
+    if (piece.offset > buf->size || piece.length > buf->size - piece.offset) reader->failed = true;
+    listAppend(pieces, piece);
+  }
+}
+
+void sessionReadRanges(SessionReader *reader, PieceTable *pt, RangeStack *stack) {
+  size_t n = sessionReadValue(reader);
+  for (size_t i = 0; i < n && !reader->failed; i++) {
+    PieceRange *pr = rangeCreate(pt, 0, 0, (Pieces) {0});
+    pr->index = sessionReadValue(reader);
+    pr->span = sessionReadValue(reader);
+    pr->group = sessionReadValue(reader);
+    sessionReadPieces(reader, pt, &pr->pieces);
+    pt->history_bytes += rangeBytes(pr);
+    listAppend(stack, pr);
+  }
+}
+
+/* Builds the tree from n pieces in order, spreading them evenly over as
+ * few nodes as possible. */
+void treeBuild(PieceTable *pt, const Piece *pieces, size_t n) {
+  size_t count = (n + PT_NODE_CAPACITY - 1) / PT_NODE_CAPACITY;
+  if (count == 0) return;
+  PieceNode **level = malloc(count * sizeof(PieceNode *));
+  size_t next = 0;
+  for (size_t i = 0; i < count; i++) {
+    PieceNode *leaf = nodeCreate(pt, true);
+    leaf->count = (n - next) / (count - i);
+    memcpy(LEAF(leaf)->pieces, &pieces[next], leaf->count * sizeof(Piece));
+    next += leaf->count;
+    nodeRecount(leaf);
+    level[i] = leaf;
+  }
+  // then each level of inner nodes over the one below it
+  while (count > 1) {
+    size_t parents = (count + PT_NODE_CAPACITY - 1) / PT_NODE_CAPACITY;
+    next = 0;
+    for (size_t i = 0; i < parents; i++) {
+      PieceNode *inner = nodeCreate(pt, false);
+      inner->count = (count - next) / (parents - i);
+      for (unsigned j = 0; j < inner->count; j++) innerSetChild(INNER(inner), j, level[next + j]);
+      next += inner->count;
+      nodeRecount(inner);
+      level[i] = inner;
+    }
+    count = parents;
+  }
+  nodeRelease(pt, pt->root);
+  pt->root = level[0];
+  pt->sequence_length = pt->root->length;
+  pt->hint_valid = false;
+  free(level);
+}
+
+/* Loads a table saved with ptSaveSession. The original file must have the
+ * same size as when the session was saved, and the same modification time
+ * or else the same contents. Returns NULL on failure. */
+PieceTable *ptLoadSession(const char *path) {
+  char *session;
+  struct stat st;
+  if (!fileMap(path, &session, &st)) return NULL;
+  SessionReader reader = { session, st.st_size, 0, false };
+  const char *magic = sessionRead(&reader, 8);
+  if (magic == NULL || memcmp(magic, SESSION_MAGIC, 8) != 0 ||
+      sessionReadValue(&reader) != SESSION_VERSION) {
+    if (session) munmap(session, st.st_size);
+    return NULL;
+  }
+  PieceTable *pt = tableCreate();
+  pt->session = session;
+  pt->session_length = st.st_size;
+
+  // map the original file again
+  size_t path_length = sessionReadValue(&reader);
+  const char *original_path = sessionRead(&reader, path_length);
+  size_t original_length = sessionReadValue(&reader);
+  int64_t mtime_sec = sessionReadValue(&reader);
+  int64_t mtime_nsec = sessionReadValue(&reader);
+  uint64_t hash = sessionReadValue(&reader);
+  char *original = NULL;
+  if (!reader.failed && path_length < 4096) {
+    char original_name[4096];
+    memcpy(original_name, original_path, path_length);
+    original_name[path_length] = '\0';
+    if (fileMap(original_name, &original, &st)) {
+      if (original) {
+        listAppend(&pt->original.segments, ((Segment) {
+          .elems = original,
+          .size = st.st_size,
+          .capacity = st.st_size,
+          .kind = Mapped,
+        }));
+        pt->original.size = st.st_size;
+      }
+      // a file that was touched but not changed is still the original
+      if ((size_t) st.st_size != original_length ||
+          ((st.st_mtim.tv_sec != mtime_sec || st.st_mtim.tv_nsec != mtime_nsec) &&
+           hashChars(original, original_length) != hash)) {
+        reader.failed = true;
+      }
+    } else {
+      reader.failed = true;
+    }
+  } else {
+    reader.failed = true;
+  }
+  sessionReadOffsets(&reader, &pt->original.newlines);
+  sessionReadMetrics(&reader, &pt->original);
+
+  // the add buffer chars are borrowed from the session
+  Buffer *add = &pt->add;
+  add->size = sessionReadValue(&reader);
+  size_t segments = sessionReadValue(&reader);
+  for (size_t i = 0; i < segments && !reader.failed; i++) {
+    Segment segment = { .kind = Borrowed };
+    segment.offset = sessionReadValue(&reader);
+    segment.size = segment.capacity = sessionReadValue(&reader);
+    segment.sample = sessionReadValue(&reader);
+    listAppend(&add->segments, segment);
+  }
+  sessionReadOffsets(&reader, &add->newlines);
+  sessionReadMetrics(&reader, add);
+  for (size_t i = 0; i < add->segments.size && !reader.failed; i++) {
+    Segment *segment = &add->segments.elems[i];
+    if (segment->size > 0) segment->elems = (char *) sessionRead(&reader, segment->size);
+  }
+
+  pt->groups = sessionReadValue(&reader);
+  Pieces pieces = {0};
+  sessionReadPieces(&reader, pt, &pieces);
+  if (!reader.failed) treeBuild(pt, pieces.elems, pieces.size);
+  free(pieces.elems);
+  sessionReadRanges(&reader, pt, &pt->undo_stack);
+  sessionReadRanges(&reader, pt, &pt->redo_stack);
+
+  if (reader.failed) {
+    ptFree(pt);
+    return NULL;
+  }
+  return pt;
+}
+
 bool ptUndo(PieceTable *pt) {
-  if (DEBUG) debug_print("Undo: %zu", pt->undo_stack.size);
+  traceEvent(pt, TraceUndo, pt->undo_stack.size, 0);
+  traceCount(pt, undos);
   if (pt->undo_stack.size == 0) return false;
   // prevent optimized actions
   pt->last_action = Nop;
 
-  PieceRange *pr = listPop(&pt->undo_stack);
-  listAppend(&pt->redo_stack, pr);
-  rangeSwapBack(pt, pr);
+  // records of a group are swapped back together
+  PieceRange *pr;
+  do {
+    pr = listPop(&pt->undo_stack);
+    listAppend(&pt->redo_stack, pr);
+    rangeSwapBack(pt, pr);
+  } while (pr->group != 0 && pt->undo_stack.size > 0 &&
+           listPeek(&pt->undo_stack)->group == pr->group);
   return true;
 }
 
 bool ptRedo(PieceTable *pt) {
-  if (DEBUG) debug_print("Redo: %zu", pt->redo_stack.size);
+  traceEvent(pt, TraceRedo, pt->redo_stack.size, 0);
+  traceCount(pt, redos);
   if (pt->redo_stack.size == 0) return false;
   // prevent optimized actions
   pt->last_action = Nop;
 
-  PieceRange *pr = listPop(&pt->redo_stack);
-  listAppend(&pt->undo_stack, pr);
-  rangeSwapBack(pt, pr);
+  // records of a group are swapped back together
+  PieceRange *pr;
+  do {
+    pr = listPop(&pt->redo_stack);
+    listAppend(&pt->undo_stack, pr);
+    rangeSwapBack(pt, pr);
+  } while (pr->group != 0 && pt->redo_stack.size > 0 &&
+           listPeek(&pt->redo_stack)->group == pr->group);
   return true;
 }
 
+/* Limits the undo history to a number of records and to the memory they
+ * hold on to, with 0 for no limit. The oldest steps are dropped when the
+ * history goes over either. */
+void ptSetUndoBudget(PieceTable *pt, size_t records, size_t bytes) {
+  pt->undo_limit = records;
+  pt->undo_byte_limit = bytes;
+  historyTrim(pt);
+}
+
+PtUndoStats ptUndoStats(PieceTable *pt) {
+  PtUndoStats stats = {
+    .undo_records = pt->undo_stack.size,
+    .redo_records = pt->redo_stack.size,
+    .bytes = pt->history_bytes,
+    .dropped = pt->undo_dropped,
+  };
+  RangeStack *stacks[] = { &pt->undo_stack, &pt->redo_stack };
+  for (int i = 0; i < 2; i++) {
+    for (size_t j = 0; j < stacks[i]->size; j++) {
+      stats.pieces += stacks[i]->elems[j]->pieces.size;
+      stats.text_bytes += rangeTextBytes(stacks[i]->elems[j]);
+    }
+  }
+  return stats;
+}
+
+/* Returns index moved back to the start of the UTF-8 sequence it is in
+ * the middle of, so that edits never split one. Invalid sequences are left
+ * alone. */
+size_t charStart(PieceTable *pt, size_t index) {
+  if (index == 0 || index >= pt->sequence_length) return index;
+  unsigned char chars[4];
+  size_t from = index >= 3 ? index - 3 : 0;
+  size_t n = ptGetChars(pt, (char *) chars, from, index - from + 1);
+  if ((chars[n - 1] & 0xC0) != 0x80) return index;
+  for (size_t i = n - 1; i-- > 0;) {
+    if ((chars[i] & 0xC0) != 0x80) return utf8Length(chars[i]) > n - 1 - i ? from + i : index;
+  }
+  return index;
+}
+
+/* Returns index moved forward to the end of the UTF-8 sequence it is in
+ * the middle of. */
+size_t charEnd(PieceTable *pt, size_t index) {
+  size_t start = charStart(pt, index);
+  if (start == index) return index;
+  unsigned char chars[4];
+  size_t n = ptGetChars(pt, (char *) chars, start, minSize(4, pt->sequence_length - start));
+  size_t end = 1;
+  while (end < n && end < utf8Length(chars[0]) && (chars[end] & 0xC0) == 0x80) end++;
+  return start + end;
+}
+
 void ptInsertChars(PieceTable *pt, size_t index, const char *chars, size_t length) {
-  if (DEBUG) debug_print("Insert: index=%zu chars='%s' length=%zu", index, chars, length);
+  traceEvent(pt, TraceInsert, index, length);
+  traceCount(pt, inserts);
   assert(0 <= index && index <= pt->sequence_length);
   if (length <= 0) return;
+  // an insert that carries on from the last one is at a char boundary already
+  if (index != pt->prev_end_index || pt->last_action != Insert) index = charStart(pt, index);
 
-  // keep track of current offset in 'add' buffer
-  size_t add_offset = pt->add.size;
-  // add chars to 'add' buffer
-  listExtend(&pt->add, chars, length);
+  // add chars to 'add' buffer and keep track of where they went
+  size_t add_offset = bufferAppend(&pt->add, chars, length);
 
   // clear redo stack
-  listClear(&pt->redo_stack);
-
-  Piece *piece;
-  size_t current_index = 0;
-  // keep track of the index of the end of the last insertion
-  static size_t prev_end_index = -1;
-  // iterate over piece table
-  for (piece = pt->head->next; piece->next && current_index < index; piece = piece->next) {
-    size_t in_piece_offset = index - current_index;
-    current_index += piece->length;
-    if (current_index > index) {
-      // inserting in the middle of a Piece, so break this piece apart
-      // first, save the current Piece in a PieceRange
-      PieceRange *oldPR = rangeCreate(pt, piece, piece, false);
-      listAppend(&pt->undo_stack, oldPR);
-      // next, create new Pieces
-      Piece *leftPiece = pieceCreate(piece->offset, in_piece_offset, piece->which);
-      Piece *newPiece = pieceCreate(add_offset, length, Add);
-      Piece *rightPiece = pieceCreate(piece->offset + in_piece_offset, piece->length - in_piece_offset, piece->which);
-      // link them up
-      PieceRange newPR = { .boundary = false };
-      pieceAppend(&newPR, leftPiece);
-      pieceAppend(&newPR, newPiece);
-      pieceAppend(&newPR, rightPiece);
-      // swap the ranges
-      rangeSwap(oldPR, &newPR);
-    } else if (current_index == index) {
-      // insert after this piece at boundary
-      if (index == prev_end_index && pt->last_action == Insert) {
-        if (DEBUG) debug_print("Insert:     optimized at index=%zu", index);
-        // we can just extend the last Piece since our last insert ended here
-        piece->length += length;
-      } else {
-        // add current state to undo stack
-        PieceRange *oldPR = rangeCreate(pt, piece, piece->next, true);
-        listAppend(&pt->undo_stack, oldPR);
-        // create new piece
-        Piece *newPiece = pieceCreate(add_offset, length, Add);
-        PieceRange newPR = {
-          .first = newPiece,
-          .last = newPiece,
-          .boundary = false,
-        };
-        // and place it in the piece table
-        rangeSwap(oldPR, &newPR);
-      }
-    }
-  }
+  rangeStackClear(pt, &pt->redo_stack);
 
-  // deal with case where index == 0
-  // can't optimize here since prev_end_index can never be == 0
-  if (index == 0) {
+  if (index == pt->prev_end_index && pt->last_action == Insert &&
+      treeExtend(pt, index, add_offset, length)) {
+    traceCount(pt, coalesced_inserts);
+    // we extended the last Piece since our last insert ended here,
+    // so the last undo covers this insert as well
+    PieceRange *pr = listPeek(&pt->undo_stack);
+    pr->span += length;
+  } else {
     // add current state to undo stack
-    PieceRange *oldPR = rangeCreate(pt, pt->head, pt->head->next, true);
-    listAppend(&pt->undo_stack, oldPR);
-    // create new piece
-    Piece *newPiece = pieceCreate(add_offset, length, Add);
-    PieceRange newPR = {
-      .first = newPiece,
-      .last = newPiece,
-      .boundary = false,
-    };
-    // and place it in the piece table
-    rangeSwap(oldPR, &newPR);
+    Pieces none = {0};
+    rangePush(pt, rangeCreate(pt, index, length, none));
+    // create new piece and place it in the piece table
+    treeInsert(pt, index, pieceCreate(pt, add_offset, length, Add));
   }
-  
-  prev_end_index = index + length;
-  pt->sequence_length += length;
+
+  pt->prev_end_index = index + length;
   pt->last_action = Insert;
+  historyTrim(pt);
 }
 
 void ptInsertChar(PieceTable *pt, size_t index, char c) {
@@ -286,164 +1527,907 @@ void ptInsertChar(PieceTable *pt, size_t index, char c) {
 }
 
 void ptDeleteChars(PieceTable *pt, size_t index, size_t length) {
-  if (DEBUG) debug_print("Delete: index=%zu length=%zu seq_length=%zu", index, length, pt->sequence_length);
+  traceEvent(pt, TraceDelete, index, length);
+  traceCount(pt, deletes);
   assert(index + length <= pt->sequence_length);
   if (length <= 0) return;
+  // delete whole chars only
+  size_t end = charEnd(pt, index + length);
+  index = charStart(pt, index);
+  length = end - index;
 
   // clear redo stack
-  listClear(&pt->redo_stack);
-
-  Piece *piece;
-  // PieceRange for replaced pieces
-  PieceRange *oldPR = rangeCreate(pt, NULL, NULL, false);
-  // PieceRange that will be swapped with oldPR
-  PieceRange newPR = { .boundary = false };
-  bool update_prev_undo = false;
-  size_t current_index = 0;
-  size_t remaining_length = length;
-  // keep track of the last index we deleted at
-  static size_t prev_index = -1;
-  // keep track of these for optimizing consecutive deletes
-  static Piece *leftPiece = NULL;
-  static Piece *rightPiece = NULL;
+  rangeStackClear(pt, &pt->redo_stack);
 
   // TODO: implement optimization for deleting on other side
 
-  if (index + length == prev_index && pt->last_action == Delete) {
-    // we can extend the last delete "backwards"
-    if (DEBUG) debug_print("Delete:     optimized at index=%zu", index + length);
-    if (leftPiece != NULL) {
-      if (length < leftPiece->length) {
-        // just shorten the Piece to delete the rest of the Piece
-        leftPiece->length -= length;
-        pt->sequence_length -= length;
-        prev_index = index;
-        // this is all we need to do
-        debug_print("Delete:     early return; leftPiece->length=%zu", leftPiece->length);
-        return;
-      } else {
-        // this piece can be removed
-        remaining_length -= leftPiece->length;
-        pieceRemove(leftPiece);
-        leftPiece = NULL;
-        // we need to update the last undo
-        update_prev_undo = true;
-      }
-    }
-  }
+  // pieces referring to the deleted chars
+  Pieces removed = {0};
+  treeRemove(pt, index, length, &removed);
 
-  // iterate over piece table
-  for (piece = pt->head->next; piece->next && remaining_length > 0; piece = piece->next) {
-    int in_piece_offset = index - current_index;
-    current_index += piece->length;
-    if (current_index >= index) {
-      if (in_piece_offset >= 0) {
-        // first Piece in remove range
-        in_piece_offset = (size_t) in_piece_offset;
-        pieceAppend(oldPR, piece);
-        if (in_piece_offset > 0) {
-          // split and keep first half
-          leftPiece = pieceCreate(piece->offset, in_piece_offset, piece->which);
-          pieceAppend(&newPR, leftPiece);
-        }
-        // check if we need to split again and keep last part
-        if (in_piece_offset + remaining_length < piece->length) {
-          rightPiece = pieceCreate(piece->offset + in_piece_offset + remaining_length,
-                                   piece->length - in_piece_offset - remaining_length,
-                                   piece->which);
-          pieceAppend(&newPR, rightPiece);
-          remaining_length = 0;
-        } else {
-          remaining_length -= piece->length - in_piece_offset;
-        }
-      } else {
-        pieceAppend(oldPR, piece);
-        // check if only part of the last piece is removed
-        if (remaining_length < piece->length) {
-          Piece *newPiece = pieceCreate(piece->offset + remaining_length,
-                                        piece->length - remaining_length,
-                                        piece->which);
-          pieceAppend(&newPR, newPiece);
-          remaining_length = 0;
-        } else {
-          remaining_length -= piece->length;
-        }
-      }
-    }
-  }
-  
-  if (oldPR->first && oldPR->last) {
-    if (update_prev_undo) {
-      // optimized path: update the last undo
-      PieceRange *prevOldPR = listPeek(&pt->undo_stack);
-      rangeExtend(oldPR, prevOldPR);
-    } else {
-      // default: we have a new undo event
-      listAppend(&pt->undo_stack, oldPR);
-    }
-    if (newPR.first && newPR.last) {
-      rangeSwap(oldPR, &newPR);
-    }
+  if (index + length == pt->prev_index && pt->last_action == Delete) {
+    // we can extend the last delete "backwards"
+    traceCount(pt, coalesced_deletes);
+    PieceRange *pr = listPeek(&pt->undo_stack);
+    pt->history_bytes -= rangeBytes(pr);
+    listExtend(&removed, pr->pieces.elems, pr->pieces.size);
+    free(pr->pieces.elems);
+    pr->pieces = removed;
+    pr->index = index;
+    pt->history_bytes += rangeBytes(pr);
+  } else {
+    // default: we have a new undo event
+    rangePush(pt, rangeCreate(pt, index, 0, removed));
   }
 
-  prev_index = index;
-  pt->sequence_length -= length;
+  pt->prev_index = index;
   pt->last_action = Delete;
+  historyTrim(pt);
 }
 
 void ptDeleteChar(PieceTable *pt, size_t index) {
   ptDeleteChars(pt, index, 1);
 }
 
+/* Overwrites the length chars at index with chars. Chars that go past the
+ * end of the sequence are appended. */
 void ptReplaceChars(PieceTable *pt, size_t index, const char *chars, size_t length) {
-  if (DEBUG) debug_print("Replace: index=%zu chars='%s' length=%zu", index, chars, length);
+  traceEvent(pt, TraceReplace, index, length);
+  traceCount(pt, replaces);
+  assert(index <= pt->sequence_length);
+  if (length <= 0) return;
+
+  size_t add_offset = bufferAppend(&pt->add, chars, length);
+  rangeStackClear(pt, &pt->redo_stack);
+
+  // pieces referring to the overwritten chars
+  Pieces removed = {0};
+  treeRemove(pt, index, minSize(length, pt->sequence_length - index), &removed);
+
+  if (index == pt->prev_end_index && pt->last_action == Replace) {
+    // continue the last replace, which the last undo covers
+    traceCount(pt, coalesced_replaces);
+    PieceRange *pr = listPeek(&pt->undo_stack);
+    pt->history_bytes -= rangeBytes(pr);
+    listExtend(&pr->pieces, removed.elems, removed.size);
+    free(removed.elems);
+    pr->span += length;
+    pt->history_bytes += rangeBytes(pr);
+    if (!treeExtend(pt, index, add_offset, length)) {
+      treeInsert(pt, index, pieceCreate(pt, add_offset, length, Add));
+    }
+  } else {
+    // the new text and the text it replaced make one undo event
+    rangePush(pt, rangeCreate(pt, index, length, removed));
+    treeInsert(pt, index, pieceCreate(pt, add_offset, length, Add));
+  }
 
+  pt->prev_end_index = index + length;
+  pt->last_action = Replace;
+  historyTrim(pt);
 }
 
 void ptReplaceChar(PieceTable *pt, size_t index, char c) {
   ptReplaceChars(pt, index, &c, 1);
 }
 
+int editCompare(const void *a, const void *b) {
+  const PtEdit *edit_a = *(const PtEdit **) a;
+  const PtEdit *edit_b = *(const PtEdit **) b;
+  if (edit_a->offset != edit_b->offset) return edit_a->offset < edit_b->offset ? -1 : 1;
+  // keep inserts at the same offset in the order they were given
+  return edit_a < edit_b ? -1 : edit_a > edit_b;
+}
+
+/* Applies n edits given as offsets into the current sequence, in a single
+ * pass in order of offset. The edits must not overlap. They are undone and
+ * redone together as one group of records. */
+void ptApplyEdits(PieceTable *pt, const PtEdit *edits, size_t n) {
+  traceEvent(pt, TraceApplyEdits, 0, n);
+  if (n == 0) return;
+
+  const PtEdit **sorted = malloc(n * sizeof(PtEdit *));
+  for (size_t i = 0; i < n; i++) sorted[i] = &edits[i];
+  qsort(sorted, n, sizeof(PtEdit *), editCompare);
+
+  // apply the edits front to back, shifting each by the ones before it
+  rangeStackClear(pt, &pt->redo_stack);
+  size_t group = ++pt->groups;
+  size_t end = 0;
+  size_t shift = 0;
+  for (size_t i = 0; i < n; i++) {
+    const PtEdit *edit = sorted[i];
+    assert(edit->offset >= end);
+    end = edit->offset + edit->delete_length;
+    assert(end <= pt->sequence_length - shift);
+
+    size_t index = edit->offset + shift;
+    Pieces removed = {0};
+    treeRemove(pt, index, edit->delete_length, &removed);
+    if (edit->length > 0) {
+      size_t add_offset = bufferAppend(&pt->add, edit->chars, edit->length);
+      treeInsert(pt, index, pieceCreate(pt, add_offset, edit->length, Add));
+    }
+    PieceRange *pr = rangeCreate(pt, index, edit->length, removed);
+    pr->group = group;
+    rangePush(pt, pr);
+    shift += edit->length - edit->delete_length;
+  }
+  free(sorted);
+  pt->last_action = Nop;
+  historyTrim(pt);
+}
+
+/* Appends pointers to the Add pieces under node to refs. */
+void nodeAddPieces(PieceNode *node, PieceRefs *refs) {
+  for (unsigned i = 0; i < node->count; i++) {
+    if (!node->leaf) {
+      nodeAddPieces(INNER(node)->children[i], refs);
+    } else if (LEAF(node)->pieces[i].which == Add) {
+      listAppend(refs, &LEAF(node)->pieces[i]);
+    }
+  }
+}
+
+/* Appends pointers to the Add pieces kept by the records of stack to refs. */
+void rangeStackAddPieces(RangeStack *stack, PieceRefs *refs) {
+  for (size_t i = 0; i < stack->size; i++) {
+    Pieces *pieces = &stack->elems[i]->pieces;
+    for (size_t j = 0; j < pieces->size; j++) {
+      if (pieces->elems[j].which == Add) listAppend(refs, &pieces->elems[j]);
+    }
+  }
+}
+
+int pieceRefCompare(const void *a, const void *b) {
+  const Piece *piece_a = *(const Piece **) a;
+  const Piece *piece_b = *(const Piece **) b;
+  return piece_a->offset < piece_b->offset ? -1 : piece_a->offset > piece_b->offset;
+}
+
+/* Frees the add buffer segments that no piece of the sequence or the undo
+ * history refers to. Segments that are mostly unused have the text still
+ * in use moved to the end of the add buffer first, and the pieces that
+ * refer to it are pointed at the new copy. */
+void compactCollect(PieceTable *pt) {
+  PieceRefs refs = {0};
+  nodeAddPieces(pt->root, &refs);
+  rangeStackAddPieces(&pt->undo_stack, &refs);
+  rangeStackAddPieces(&pt->redo_stack, &refs);
+  if (refs.size > 0) qsort(refs.elems, refs.size, sizeof(Piece *), pieceRefCompare);
+
+  // the last segment is still being appended to, and is where the moved
+  // text goes, so it stays
+  size_t segments = pt->add.segments.size;
+  size_t i = 0;
+  bool freed = false;
+  for (size_t s = 0; s + 1 < segments; s++) {
+    Segment *segment = &pt->add.segments.elems[s];
+    if (segment->elems == NULL) continue;
+    size_t segment_end = segment->offset + segment->size;
+
+    // the pieces in the segment are refs[i..j), which may overlap
+    size_t j = i, used = 0, used_end = 0;
+    for (; j < refs.size && refs.elems[j]->offset < segment_end; j++) {
+      Piece *piece = refs.elems[j];
+      size_t start = piece->offset > used_end ? piece->offset : used_end;
+      if (piece->offset + piece->length > start) {
+        used += piece->offset + piece->length - start;
+        used_end = piece->offset + piece->length;
+      }
+    }
+    if (used * 2 >= segment->size) {
+      i = j;
+      continue;
+    }
+
+    // move each run of text in use, which appending may move the segments
+    // list but not the chars in them
+    const char *chars = segment->elems;
+    size_t segment_offset = segment->offset;
+    while (i < j) {
+      size_t start = refs.elems[i]->offset, end = start + refs.elems[i]->length;
+      size_t k = i + 1;
+      for (; k < j && refs.elems[k]->offset <= end; k++) {
+        end = end > refs.elems[k]->offset + refs.elems[k]->length ? end : refs.elems[k]->offset + refs.elems[k]->length;
+      }
+      size_t moved = bufferAppend(&pt->add, &chars[start - segment_offset], end - start);
+      for (; i < k; i++) refs.elems[i]->offset = moved + refs.elems[i]->offset - start;
+    }
+    segmentFree(&pt->add.segments.elems[s]);
+    freed = true;
+  }
+  free(refs.elems);
+  if (!freed) return;
+
+  // drop the newlines of the freed segments from the index
+  Offsets *newlines = &pt->add.newlines;
+  size_t kept = 0;
+  for (size_t k = 0; k < newlines->size; k++) {
+    if (bufferSegment(&pt->add, newlines->elems[k])->elems != NULL) {
+      newlines->elems[kept++] = newlines->elems[k];
+    }
+  }
+  newlines->size = kept;
+}
+
+/* Compacts the piece sequence without changing its text, so the undo
+ * history stays valid. Adjacent pieces that are contiguous in a buffer are
+ * merged, and runs of pieces shorter than policy.small_length have their
+ * text copied to the add buffer and are replaced by a single piece. At the
+ * end of a pass over the sequence, add buffer segments are collected if
+ * policy.collect is set and there are no snapshots of the table.
+ *
+ * A pass can be spread over several calls by giving it a budget of pieces
+ * to visit on each. Returns true when a pass was finished. */
+bool ptCompact(PieceTable *pt, PtCompactPolicy policy) {
+  traceEvent(pt, TraceCompact, pt->compact_index, policy.budget);
+  assert(pt->source == NULL);
+  pt->last_action = Nop;
+
+  size_t index = pt->compact_index;
+  for (size_t visited = 0; policy.budget == 0 || visited < policy.budget; visited++) {
+    if (index >= pt->sequence_length) break;
+    PieceCursor cur;
+    treeSeek(pt, index, &cur);
+    index = cur.start;
+    size_t end = index + cursorPiece(&cur)->length;
+    // the piece may be contiguous with the next one more than once
+    if (treeJoin(pt, end)) continue;
+
+    // find a run of small pieces that fits in a segment and the budget
+    size_t run = 0, run_length = 0;
+    do {
+      size_t length = cursorPiece(&cur)->length;
+      if (length >= policy.small_length || run_length + length > PT_SEGMENT_CAPACITY) break;
+      if (policy.budget > 0 && visited + run == policy.budget) break;
+      run++;
+      run_length += length;
+    } while (cursorNext(&cur));
+    if (run < 2) {
+      index = end;
+      continue;
+    }
+
+    char *chars = malloc(run_length);
+    ptGetChars(pt, chars, index, run_length);
+    Pieces removed = {0};
+    treeRemove(pt, index, run_length, &removed);
+    size_t add_offset = bufferAppend(&pt->add, chars, run_length);
+    treeInsert(pt, index, pieceCreate(pt, add_offset, run_length, Add));
+    free(removed.elems);
+    free(chars);
+    visited += run - 1;
+    index += run_length;
+  }
+
+  if (index < pt->sequence_length) {
+    pt->compact_index = index;
+    return false;
+  }
+  pt->compact_index = 0;
+  snapshotReclaim(pt);
+  if (policy.collect && pt->snapshots == 0) compactCollect(pt);
+  return true;
+}
+
 size_t ptGetChars(PieceTable *pt, char *dest, size_t index, size_t length) {
   assert(index + length <= pt->sequence_length);
   if (length <= 0) return 0;
 
-  Piece *piece;
-  size_t current_index = 0;
+  PieceIterator it = ptIterBegin(pt, index);
+  Span span;
   size_t total = 0;
-  for (piece = pt->head->next; piece->next && current_index < index + length; piece = piece->next) {
-    Buffer buf = piece->which == Original ? pt->original : pt->add;
-    int in_piece_offset = index - current_index;
-    current_index += piece->length;
-    if (current_index >= index) {
-      size_t current_length = 0;
-      if (in_piece_offset > 0) {
-        // split first piece in range
-        current_length = piece->length - (size_t) in_piece_offset;
-        memcpy(dest, &buf.elems[piece->offset+in_piece_offset], current_length * sizeof(*buf.elems));
-      } else {
-        size_t rest_piece_length = 0;
-        if (current_index > index + length) {
-          // split last piece in range
-          rest_piece_length = current_index - (index + length);
-        }
-        current_length = piece->length - rest_piece_length;
-        memcpy(dest, &buf.elems[piece->offset], current_length * sizeof(*buf.elems));
+  while (total < length && ptIterNext(&it, &span)) {
+    size_t current_length = minSize(span.length, length - total);
+    memcpy(&dest[total], span.chars, current_length);
+    total += current_length;
+  }
+  return total;
+}
+
+/* Returns an iterator over the text of the sequence positioned at offset.
+ * The iterator is invalidated by any edit to the piece table. */
+PieceIterator ptIterBegin(PieceTable *pt, size_t offset) {
+  assert(offset <= pt->sequence_length);
+  PieceIterator it = {
+    .pt = pt,
+    .offset = offset,
+  };
+  treeSeek(pt, offset, &it.cur);
+  return it;
+}
+
+/* Gets the text from the iterator position to the end of its piece and
+ * moves the iterator past it. Returns false at the end of the sequence. */
+bool ptIterNext(PieceIterator *it, Span *span) {
+  if (!cursorValid(&it->cur)) return false;
+  Piece *piece = cursorPiece(&it->cur);
+  size_t in_piece_offset = it->offset - it->cur.start;
+  span->chars = pieceChars(it->pt, piece) + in_piece_offset;
+  span->length = piece->length - in_piece_offset;
+  it->offset += span->length;
+  cursorNext(&it->cur);
+  return true;
+}
+
+/* Gets the text from the start of the piece before the iterator position
+ * up to it and moves the iterator back before it. Returns false at the
+ * start of the sequence. */
+bool ptIterPrev(PieceIterator *it, Span *span) {
+  if (it->offset == it->cur.start && !cursorPrev(&it->cur)) return false;
+  Piece *piece = cursorPiece(&it->cur);
+  span->chars = pieceChars(it->pt, piece);
+  span->length = it->offset - it->cur.start;
+  it->offset = it->cur.start;
+  return true;
+}
+
+/* Returns the number of lines in the sequence. */
+size_t ptLineCount(PieceTable *pt) {
+  return pt->root->newlines + 1;
+}
+
+/* Returns the index of the first char of line, counting from 0. */
+size_t ptLineToOffset(PieceTable *pt, size_t line) {
+  assert(line < ptLineCount(pt));
+  if (line == 0) return 0;
+
+  // the line starts after the line-th newline
+  PieceCursor cur;
+  treeSeekNewline(pt, line, &cur);
+  Piece *piece = cursorPiece(&cur);
+  Buffer *buf = pieceBuffer(pt, piece);
+  size_t newline = buf->newlines.elems[bufferNewlineAt(buf, piece->offset) + line - cur.newlines - 1];
+  return cur.start + newline - piece->offset + 1;
+}
+
+/* Returns the line containing the char at offset, counting from 0. */
+size_t ptOffsetToLine(PieceTable *pt, size_t offset) {
+  assert(offset <= pt->sequence_length);
+
+  PieceCursor cur;
+  treeSeek(pt, offset, &cur);
+  if (!cursorValid(&cur)) return cur.newlines;
+  // count the newlines in the piece before offset
+  Piece *piece = cursorPiece(&cur);
+  Buffer *buf = pieceBuffer(pt, piece);
+  size_t in_piece_offset = offset - cur.start;
+  return cur.newlines + bufferNewlineAt(buf, piece->offset + in_piece_offset) - bufferNewlineAt(buf, piece->offset);
+}
+
+typedef enum { Codepoints, Width } Metric;
+
+size_t pieceMetric(const Piece *piece, Metric metric) {
+  return metric == Codepoints ? piece->codepoints : piece->width;
+}
+
+size_t innerMetric(const PieceInner *inner, unsigned i, Metric metric) {
+  return metric == Codepoints ? inner->codepoints[i] : inner->widths[i];
+}
+
+/* Returns how many of the length chars at offset of the buffer come before
+ * the char that takes metric past value, counting from offset. */
+size_t bufferMetricSeek(Buffer *buf, size_t offset, size_t length, Metric metric, size_t value) {
+  Segment *segment = bufferSegment(buf, offset);
+  const unsigned char *chars = (const unsigned char *) segment->elems;
+  size_t start = offset - segment->offset, end = start + length;
+  TextMetrics metrics = bufferMetricsAt(buf, offset);
+  size_t goal = (metric == Codepoints ? metrics.codepoints : metrics.width) + value;
+
+  // skip to the last sample in the range that is not past the goal, and
+  // back to the start of the char it is in
+  size_t lo = start / PT_METRICS_BLOCK + 1, hi = end / PT_METRICS_BLOCK + 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    TextMetrics sample = buf->samples.elems[segment->sample + mid];
+    if ((metric == Codepoints ? sample.codepoints : sample.width) <= goal) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  size_t pos = start;
+  if (lo - 1 > start / PT_METRICS_BLOCK) {
+    pos = (lo - 1) * PT_METRICS_BLOCK;
+    for (int k = 0; k < 3 && pos > start && pos < end && (chars[pos] & 0xC0) == 0x80; k++) pos--;
+    metrics = bufferMetricsAt(buf, segment->offset + pos);
+  }
+  size_t reached = metric == Codepoints ? metrics.codepoints : metrics.width;
+
+  // then step over the chars that fit
+  while (pos < end) {
+    size_t ascii = minSize(utf8Ascii((const char *) &chars[pos], end - pos), goal - reached);
+    pos += ascii;
+    reached += ascii;
+    if (pos == end) break;
+    unsigned width;
+    size_t n = utf8Next((const char *) &chars[pos], end - pos, &width);
+    size_t step = metric == Codepoints ? (chars[pos] & 0xC0) != 0x80 : width;
+    if (reached + step > goal) break;
+    reached += step;
+    pos += n;
+  }
+  return pos - start;
+}
+
+/* Returns the metrics of the sequence before index. */
+TextMetrics treeMetricsAt(PieceTable *pt, size_t index) {
+  TextMetrics metrics = {0};
+  PieceNode *node = pt->root;
+  size_t start = 0;
+  while (!node->leaf) {
+    PieceInner *inner = INNER(node);
+    unsigned i = 0;
+    while (i + 1 < node->count && index >= start + inner->lengths[i]) {
+      start += inner->lengths[i];
+      metrics.codepoints += inner->codepoints[i];
+      metrics.width += inner->widths[i++];
+    }
+    node = inner->children[i];
+  }
+  PieceLeaf *leaf = LEAF(node);
+  unsigned i = 0;
+  while (i < node->count && index >= start + leaf->pieces[i].length) {
+    start += leaf->pieces[i].length;
+    metrics.codepoints += leaf->pieces[i].codepoints;
+    metrics.width += leaf->pieces[i++].width;
+  }
+  if (i < node->count && index > start) {
+    // count the start of the piece up to index
+    Piece *piece = &leaf->pieces[i];
+    TextMetrics part = bufferMetrics(pieceBuffer(pt, piece), piece->offset, index - start);
+    metrics.codepoints += part.codepoints;
+    metrics.width += part.width;
+  }
+  return metrics;
+}
+
+/* Returns the index of the char that takes metric of the sequence past
+ * value, or the length of the sequence if none does. */
+size_t treeMetricSeek(PieceTable *pt, Metric metric, size_t value) {
+  PieceNode *node = pt->root;
+  size_t start = 0, reached = 0;
+  while (!node->leaf) {
+    PieceInner *inner = INNER(node);
+    unsigned i = 0;
+    while (i + 1 < node->count && value >= reached + innerMetric(inner, i, metric)) {
+      start += inner->lengths[i];
+      reached += innerMetric(inner, i++, metric);
+    }
+    node = inner->children[i];
+  }
+  PieceLeaf *leaf = LEAF(node);
+  unsigned i = 0;
+  while (i < node->count && value >= reached + pieceMetric(&leaf->pieces[i], metric)) {
+    start += leaf->pieces[i].length;
+    reached += pieceMetric(&leaf->pieces[i++], metric);
+  }
+  if (i == node->count) return pt->sequence_length;
+  Piece *piece = &leaf->pieces[i];
+  return start + bufferMetricSeek(pieceBuffer(pt, piece), piece->offset, piece->length, metric, value - reached);
+}
+
+/* Returns the number of codepoints in the sequence. */
+size_t ptCodepointCount(PieceTable *pt) {
+  return pt->root->codepoints;
+}
+
+/* Returns the number of codepoints before offset. */
+size_t ptOffsetToCodepoint(PieceTable *pt, size_t offset) {
+  assert(offset <= pt->sequence_length);
+  return treeMetricsAt(pt, offset).codepoints;
+}
+
+/* Returns the index of the first char of a codepoint, counting from 0, or
+ * the length of the sequence past the last one. */
+size_t ptCodepointToOffset(PieceTable *pt, size_t codepoint) {
+  return treeMetricSeek(pt, Codepoints, codepoint);
+}
+
+/* Returns the column offset is at in its line, counting the columns each
+ * char takes in a terminal from 0. */
+size_t ptOffsetToColumn(PieceTable *pt, size_t offset) {
+  assert(offset <= pt->sequence_length);
+  size_t line_start = ptLineToOffset(pt, ptOffsetToLine(pt, offset));
+  return treeMetricsAt(pt, offset).width - treeMetricsAt(pt, line_start).width;
+}
+
+/* Returns the index of the char at column of line, or of the end of the
+ * line if it is not that wide. A column in the middle of a wide char gives
+ * the start of that char. */
+size_t ptColumnToOffset(PieceTable *pt, size_t line, size_t column) {
+  size_t line_start = ptLineToOffset(pt, line);
+  size_t line_end = line + 1 < ptLineCount(pt) ? ptLineToOffset(pt, line + 1) - 1 : pt->sequence_length;
+  size_t offset = treeMetricSeek(pt, Width, treeMetricsAt(pt, line_start).width + column);
+  return minSize(offset, line_end);
+}
+
+// Needle of a search with its Boyer-Moore-Horspool shift tables
+typedef struct {
+  const char *chars;
+  size_t length;
+  size_t forward[UCHAR_MAX + 1];  // shift for the char under the last needle char
+  size_t backward[UCHAR_MAX + 1]; // shift for the char under the first needle char
+} Needle;
+
+/* Sets up needle to search for length chars. */
+void needleInit(Needle *needle, const char *chars, size_t length) {
+  needle->chars = chars;
+  needle->length = length;
+  for (size_t c = 0; c <= UCHAR_MAX; c++) {
+    needle->forward[c] = length;
+    needle->backward[c] = length;
+  }
+  for (size_t i = 0; i + 1 < length; i++) {
+    needle->forward[(unsigned char) chars[i]] = length - 1 - i;
+  }
+  for (size_t i = length - 1; i > 0; i--) {
+    needle->backward[(unsigned char) chars[i]] = i;
+  }
+}
+
+/* Returns the index of the first match of needle in length chars, or
+ * PT_NOT_FOUND. */
+size_t needleFind(const Needle *needle, const char *chars, size_t length) {
+  size_t m = needle->length;
+  if (m > length) return PT_NOT_FOUND;
+  if (m == 1) {
+    const char *c = memchr(chars, needle->chars[0], length);
+    return c ? (size_t) (c - chars) : PT_NOT_FOUND;
+  }
+  size_t i = 0;
+#ifdef __SSE2__
+  // only positions where both the first and the last needle chars match
+  // are compared, 16 at a time
+  __m128i first = _mm_set1_epi8(needle->chars[0]);
+  __m128i last = _mm_set1_epi8(needle->chars[m - 1]);
+  for (; i + m + 15 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &chars[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &chars[i + m - 1]);
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask != 0; mask &= mask - 1) {
+      size_t j = i + __builtin_ctz(mask);
+      if (memcmp(&chars[j + 1], &needle->chars[1], m - 2) == 0) return j;
+    }
+  }
+#endif
+  for (; i <= length - m; i += needle->forward[(unsigned char) chars[i + m - 1]]) {
+    if (chars[i + m - 1] == needle->chars[m - 1] && memcmp(&chars[i], needle->chars, m - 1) == 0) return i;
+  }
+  return PT_NOT_FOUND;
+}
+
+/* Returns the index of the last match of needle in length chars, or
+ * PT_NOT_FOUND. */
+size_t needleFindLast(const Needle *needle, const char *chars, size_t length) {
+  size_t m = needle->length;
+  if (m > length) return PT_NOT_FOUND;
+  size_t end = length - m + 1; // positions left to try are below end
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(needle->chars[0]);
+  __m128i last = _mm_set1_epi8(needle->chars[m - 1]);
+  for (; end >= 16; end -= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &chars[end - 16]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &chars[end - 17 + m]);
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask != 0; mask &= ~(1u << (31 - __builtin_clz(mask)))) {
+      size_t j = end - 16 + (31 - __builtin_clz(mask));
+      if (m == 1 || memcmp(&chars[j + 1], &needle->chars[1], m - 2) == 0) return j;
+    }
+  }
+  if (end == 0) return PT_NOT_FOUND;
+#endif
+  for (size_t i = end - 1;;) {
+    if (chars[i] == needle->chars[0] && memcmp(&chars[i + 1], &needle->chars[1], m - 1) == 0) return i;
+    size_t shift = needle->backward[(unsigned char) chars[i]];
+    if (shift > i) return PT_NOT_FOUND;
+    i -= shift;
+  }
+}
+
+/* Records a match found by a search. Returns true when the search is
+ * done, which is at the first match unless it collects them in matches. */
+bool searchMatch(size_t *first, Offsets *matches, size_t index) {
+  if (*first == PT_NOT_FOUND) *first = index;
+  if (matches == NULL) return true;
+  listAppend(matches, index);
+  return false;
+}
+
+/* Returns the index of the first occurrence of needle starting at or after
+ * offset and ending by end, or PT_NOT_FOUND. When matches is given, every
+ * occurrence is appended to it in order. The search gives up when *cancel
+ * is set. The text is read in place a piece at a time, so matches can
+ * span pieces. */
+size_t searchForward(PieceTable *pt, const Needle *needle, size_t offset, size_t end,
+                     Offsets *matches, const bool *cancel) {
+  // the window holds the last length - 1 chars before the span followed
+  // by the first length - 1 chars of the span, for matches across them
+  size_t overlap = needle->length - 1;
+  char *window = overlap > 0 ? malloc(2 * overlap) : NULL;
+  size_t kept = 0; // chars in the window from before the span
+  size_t first = PT_NOT_FOUND;
+  bool done = false;
+  PieceIterator it = ptIterBegin(pt, offset);
+  Span span;
+  while (!done && it.offset < end && ptIterNext(&it, &span)) {
+    if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)) break;
+    size_t start = it.offset - span.length;
+    if (span.length > end - start) span.length = end - start;
+    size_t head = overlap < span.length ? overlap : span.length;
+    if (overlap > 0) memcpy(&window[kept], span.chars, head);
+    // matches starting in the span are found below
+    for (size_t from = 0; !done && from < kept; from++) {
+      size_t i = needleFind(needle, &window[from], kept + head - from);
+      if (i == PT_NOT_FOUND || from + i >= kept) break;
+      from += i;
+      done = searchMatch(&first, matches, start - kept + from);
+    }
+    for (size_t from = 0; !done && from < span.length; from++) {
+      size_t i = needleFind(needle, &span.chars[from], span.length - from);
+      if (i == PT_NOT_FOUND) break;
+      from += i;
+      done = searchMatch(&first, matches, start + from);
+    }
+    if (overlap == 0) continue; // single chars cannot span pieces
+    if (span.length >= overlap) {
+      memcpy(window, &span.chars[span.length - overlap], overlap);
+      kept = overlap;
+    } else {
+      // the whole span is in the window already
+      size_t drop = kept + head > overlap ? kept + head - overlap : 0;
+      memmove(window, &window[drop], kept + head - drop);
+      kept = kept + head - drop;
+    }
+  }
+  free(window);
+  return first;
+}
+
+/* Returns the index of the first occurrence of the length chars at chars
+ * starting at or after offset, or PT_NOT_FOUND. */
+size_t ptSearchForward(PieceTable *pt, size_t offset, const char *chars, size_t length) {
+  assert(offset <= pt->sequence_length);
+  if (length == 0) return offset;
+  Needle needle;
+  needleInit(&needle, chars, length);
+  return searchForward(pt, &needle, offset, pt->sequence_length, NULL, NULL);
+}
+
+/* Returns the index of the last occurrence of the length chars at chars
+ * ending at or before offset, or PT_NOT_FOUND. */
+size_t ptSearchBackward(PieceTable *pt, size_t offset, const char *chars, size_t length) {
+  assert(offset <= pt->sequence_length);
+  if (length == 0) return offset;
+  Needle needle;
+  needleInit(&needle, chars, length);
+
+  // the window holds the last length - 1 chars of the span followed by
+  // the first length - 1 chars after it, which are kept in after
+  size_t overlap = length - 1;
+  char *window = overlap > 0 ? malloc(3 * overlap) : NULL;
+  char *after = window ? &window[2 * overlap] : NULL;
+  size_t kept = 0; // chars in after
+  size_t found = PT_NOT_FOUND;
+  PieceIterator it = ptIterBegin(pt, offset);
+  Span span;
+  while (ptIterPrev(&it, &span)) {
+    size_t tail = overlap < span.length ? overlap : span.length;
+    if (kept > 0) {
+      memcpy(window, &span.chars[span.length - tail], tail);
+      memcpy(&window[tail], after, kept);
+      // matches ending in the span are found below
+      size_t i = needleFindLast(&needle, window, tail + kept);
+      if (i != PT_NOT_FOUND && i + length > tail) {
+        found = it.offset + span.length - tail + i;
+        break;
       }
-      total += current_length;
-      dest += current_length;
+    }
+    size_t i = needleFindLast(&needle, span.chars, span.length);
+    if (i != PT_NOT_FOUND) {
+      found = it.offset + i;
+      break;
+    }
+    if (overlap == 0) continue; // single chars cannot span pieces
+    if (span.length >= overlap) {
+      memcpy(after, span.chars, overlap);
+      kept = overlap;
+    } else {
+      // the span goes in front of what is kept
+      size_t keep = kept + tail > overlap ? overlap - tail : kept;
+      memmove(&after[tail], after, keep);
+      memcpy(after, span.chars, tail);
+      kept = tail + keep;
     }
   }
-  return total;
+  free(window);
+  return found;
+}
+
+// Byte range of a parallel search and the matches found in it
+typedef struct {
+  PieceTable view; // copy of the table with its own hint to seek with
+  const Needle *needle;
+  size_t start;
+  size_t end; // matches start before end
+  Offsets matches;
+  const bool *cancel;
+} SearchShard;
+
+/* Finds the matches in a shard, on a worker thread. */
+void *searchShard(void *arg) {
+  SearchShard *shard = arg;
+  size_t end = shard->end + shard->needle->length - 1;
+  if (end > shard->view.sequence_length) end = shard->view.sequence_length;
+  searchForward(&shard->view, shard->needle, shard->start, end, &shard->matches, shard->cancel);
+  return NULL;
+}
+
+/* Appends the index of every occurrence of the length chars at chars to
+ * matches in order, overlapping ones included. The text is split into
+ * threads byte ranges, each overlapping the next by length - 1 chars, that
+ * are searched in parallel. pt is only read, so it should be a snapshot
+ * if its table is edited meanwhile. Returns false without adding any
+ * matches if *cancel is set, which can be done with __atomic_store_n from
+ * another thread, before the search is done. */
+bool ptSearchAll(PieceTable *pt, const char *chars, size_t length, unsigned threads,
+                 const bool *cancel, Offsets *matches) {
+  if (length == 0 || length > pt->sequence_length) return !(cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED));
+  if (threads == 0) threads = 1;
+  Needle needle;
+  needleInit(&needle, chars, length);
+
+  SearchShard *shards = calloc(threads, sizeof(SearchShard));
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  bool *started = calloc(threads, sizeof(bool));
+  size_t shard_length = (pt->sequence_length + threads - 1) / threads;
+  for (unsigned t = 0; t < threads; t++) {
+    SearchShard *shard = &shards[t];
+    shard->view = *pt;
+    shard->view.hint_valid = false;
+    shard->view.trace = NULL;
+    shard->needle = &needle;
+    shard->start = t * shard_length < pt->sequence_length ? t * shard_length : pt->sequence_length;
+    shard->end = pt->sequence_length - shard->start > shard_length ? shard->start + shard_length : pt->sequence_length;
+    shard->cancel = cancel;
+  }
+  // the first shard is searched on this thread, as are the others if
+  // their threads cannot be started
+  for (unsigned t = 1; t < threads; t++) {
+    started[t] = pthread_create(&workers[t], NULL, searchShard, &shards[t]) == 0;
+  }
+  searchShard(&shards[0]);
+  for (unsigned t = 1; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(workers[t], NULL);
+    } else {
+      searchShard(&shards[t]);
+    }
+  }
+
+  bool cancelled = cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED);
+  for (unsigned t = 0; t < threads; t++) {
+    if (!cancelled && shards[t].matches.size > 0) {
+      listExtend(matches, shards[t].matches.elems, shards[t].matches.size);
+    }
+    free(shards[t].matches.elems);
+  }
+  free(started);
+  free(workers);
+  free(shards);
+  return !cancelled;
+}
+
+/* Returns the counters of pt, which stay at 0 unless it is built with
+ * PT_TRACE, along with the depth of its history. */
+PtStats ptGetStats(PieceTable *pt) {
+  PtStats stats = pt->stats;
+  stats.undo_depth = pt->undo_stack.size;
+  stats.redo_depth = pt->redo_stack.size;
+  return stats;
+}
+
+/* Writes the counters of pt and the events in its trace ring, oldest
+ * first, to fp. This can be called from another thread than the one using
+ * pt, in which case the counters may be slightly behind. */
+void ptDumpTrace(PieceTable *pt, FILE *fp) {
+  PtStats stats = ptGetStats(pt);
+  fprintf(fp, "inserts=%zu (coalesced %zu) deletes=%zu (coalesced %zu) replaces=%zu (coalesced %zu)\n",
+          stats.inserts, stats.coalesced_inserts, stats.deletes, stats.coalesced_deletes,
+          stats.replaces, stats.coalesced_replaces);
+  fprintf(fp, "undos=%zu redos=%zu undo_depth=%zu redo_depth=%zu\n",
+          stats.undos, stats.redos, stats.undo_depth, stats.redo_depth);
+  fprintf(fp, "seeks=%zu (from hint %zu) pieces_walked=%zu piece_splits=%zu piece_joins=%zu\n",
+          stats.seeks, stats.hint_seeks, stats.pieces_walked, stats.piece_splits, stats.piece_joins);
+
+  TraceRing *ring = pt->trace;
+  if (ring == NULL) return;
+  // copy the ring, then drop the events that were or are being
+  // overwritten meanwhile
+  TraceEvent events[PT_TRACE_EVENTS];
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  memcpy(events, ring->events, sizeof(events));
+  size_t last_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t first = last_head >= PT_TRACE_EVENTS ? last_head - PT_TRACE_EVENTS + 1 : 0;
+  for (size_t i = first; i < head; i++) {
+    TraceEvent *event = &events[i % PT_TRACE_EVENTS];
+    fprintf(fp, "%zu %s index=%zu length=%zu\n", i, trace_names[event->kind], event->index, event->length);
+  }
+}
+
+/* Writes the text of pt to fd straight from its buffers, IOV_MAX pieces
+ * at a time. Returns false on failure. */
+bool ptWriteToFd(PieceTable *pt, int fd) {
+  struct iovec iov[IOV_MAX];
+  int n = 0;
+  PieceIterator it = ptIterBegin(pt, 0);
+  Span span;
+  while (ptIterNext(&it, &span)) {
+    iov[n].iov_base = (char *) span.chars;
+    iov[n++].iov_len = span.length;
+    if (n == IOV_MAX) {
+      if (!writeAll(fd, iov, n)) return false;
+      n = 0;
+    }
+  }
+  return writeAll(fd, iov, n);
+}
+
+/* Replaces the file at path with the text of pt. The text is written to a
+ * temporary file next to it, which is renamed over it once complete, so
+ * the file is never left half written and a mapping of the old file stays
+ * valid. With sync the text is on disk when this returns. Returns false on
+ * failure, leaving the file as it was. */
+bool ptWriteToFile(PieceTable *pt, const char *path, bool sync) {
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  if (fd == -1) return false;
+
+  // keep the permissions of the file, or give it the ones a new file gets
+  struct stat st;
+  mode_t mode;
+  if (stat(path, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  bool written = fchmod(fd, mode) == 0 && ptWriteToFd(pt, fd) && (!sync || fsync(fd) == 0);
+  if (close(fd) != 0 || !written || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+    return false;
+  }
+  if (sync) {
+    // and so is the rename
+    char dir_path[4096];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    char *slash = strrchr(dir_path, '/');
+    if (slash == dir_path) {
+      slash[1] = '\0';
+    } else if (slash) {
+      *slash = '\0';
+    } else {
+      strcpy(dir_path, ".");
+    }
+    int dir = open(dir_path, O_RDONLY);
+    if (dir != -1) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+  return true;
 }
 
 void ptPrint(PieceTable *pt) {
-  Piece *piece;
-  for (piece = pt->head->next; piece->next; piece = piece->next) {
-    Buffer buf = piece->which == Original ? pt->original : pt->add;
-    fwrite(&buf.elems[piece->offset], sizeof(*buf.elems), piece->length, stdout);
+  PieceIterator it = ptIterBegin(pt, 0);
+  Span span;
+  while (ptIterNext(&it, &span)) {
+    fwrite(span.chars, sizeof(char), span.length, stdout);
   }
   fwrite("\n", sizeof(char), 1, stdout);
   fflush(stdout);
 }
-
@@ -10,29 +10,156 @@
 // Reference: https://www.catch22.net/tuts/neatpad/piece-chains/
 
 typedef struct {
-  char *elems; // TODO: free buffer elems
+  size_t *elems;
   size_t size;
   size_t capacity;
-} Buffer; 
+} Offsets;
+
+// Buffers are kept in segments that never move or grow past their capacity,
+// so appending text never copies what is already there. Offsets into a
+// buffer skip a char between segments so that pieces in different segments
+// never look contiguous.
+#define PT_SEGMENT_CAPACITY (64 * 1024)
+#define PT_SPILL_LENGTH (16 * 1024 * 1024) // appends this long go to a temporary file
+
+// Buffers sample the codepoints and display width of their text every
+// PT_METRICS_BLOCK chars, so that the metrics of any range of a buffer can
+// be found by counting at most a block at each end.
+#define PT_METRICS_BLOCK 1024
+
+typedef enum { Borrowed, Allocated, Mapped } SegmentKind;
+
+typedef struct {
+  char *elems;
+  size_t offset; // offset of the first char in the buffer
+  size_t size;
+  size_t capacity;
+  SegmentKind kind;
+  size_t sample; // index of the metrics at the start of the segment in the buffer's samples
+} Segment;
+
+typedef struct {
+  Segment *elems;
+  size_t size;
+  size_t capacity;
+} Segments;
+
+// Codepoints and display width of some text
+typedef struct {
+  size_t codepoints;
+  size_t width;
+} TextMetrics;
+
+typedef struct {
+  TextMetrics *elems;
+  size_t size;
+  size_t capacity;
+} MetricsSamples;
+
+typedef struct {
+  Segments segments;
+  size_t size;      // offset one past the last char in the buffer
+  Offsets newlines; // sorted offsets of the '\n' chars in the buffer
+  MetricsSamples samples; // metrics of the buffer before every PT_METRICS_BLOCK chars of each segment
+  TextMetrics total;      // metrics of the whole buffer
+} Buffer;
 
 typedef enum { Original, Add } WhichBuffer;
 
-typedef struct PIECE {
+typedef struct {
   size_t offset;
   size_t length;
+  size_t newlines; // number of '\n' chars in the piece
+  size_t codepoints;
+  size_t width;    // columns the piece takes in a terminal
   WhichBuffer which;
-  struct PIECE *next;
-  struct PIECE *prev;
 } Piece;
 
-typedef enum { Insert, Delete, Nop } Action;
+typedef struct {
+  Piece *elems;
+  size_t size;
+  size_t capacity;
+} Pieces;
 
 typedef struct {
-  Piece *first;
-  Piece *last;
-  bool boundary;
-  size_t sequence_length;
-} PieceRange; // TODO: free ranges
+  Piece **elems;
+  size_t size;
+  size_t capacity;
+} PieceRefs;
+
+// The piece sequence is stored in a B+tree. Leaves hold packed arrays of
+// pieces and inner nodes hold the byte, newline, codepoint and width totals
+// of their children, so finding the piece at an index, line, codepoint or
+// column, splitting it and removing a range are O(log n). Nodes are shared
+// with snapshots and copied before they are changed while shared.
+#define PT_NODE_CAPACITY 32
+#define PT_NODE_MIN (PT_NODE_CAPACITY / 4)
+#define PT_MAX_DEPTH 16
+
+typedef struct {
+  bool leaf;
+  unsigned count;
+  unsigned refs;   // number of parents and roots pointing at this node
+  size_t length;   // total length of the pieces in this subtree
+  size_t newlines; // total newlines of the pieces in this subtree
+  size_t codepoints;
+  size_t width;
+} PieceNode;
+
+typedef struct {
+  PieceNode node;
+  Piece pieces[PT_NODE_CAPACITY];
+} PieceLeaf;
+
+typedef struct {
+  PieceNode node;
+  size_t lengths[PT_NODE_CAPACITY];
+  size_t newlines[PT_NODE_CAPACITY];
+  size_t codepoints[PT_NODE_CAPACITY];
+  size_t widths[PT_NODE_CAPACITY];
+  PieceNode *children[PT_NODE_CAPACITY];
+} PieceInner;
+
+// Path from the root to a piece in the tree
+typedef struct {
+  PieceNode *nodes[PT_MAX_DEPTH];
+  unsigned slots[PT_MAX_DEPTH];
+  unsigned depth;  // level of the leaf in nodes
+  size_t start;    // index of the first char of the piece in the sequence
+  size_t newlines; // newlines in the sequence before the piece
+} PieceCursor;
+
+// Allocator for objects of one size. Objects are carved out of blocks of
+// SLAB_BLOCK_OBJECTS and recycled through a free list, and all blocks are
+// released at once when the slab is freed.
+#define SLAB_BLOCK_OBJECTS 64
+
+typedef struct SLAB_BLOCK {
+  struct SLAB_BLOCK *next;
+} SlabBlock;
+
+typedef struct SLAB_OBJECT {
+  struct SLAB_OBJECT *next;
+} SlabObject;
+
+typedef struct {
+  size_t object_size;
+  SlabBlock *blocks;
+  SlabObject *free_list;
+} Slab;
+
+typedef enum { Insert, Delete, Replace, Nop } Action;
+
+// Undo/redo record: the text in [index, index + span) of the sequence was
+// swapped in for pieces. Swapping back exchanges the two. A range with no
+// pieces is a boundary (the edit was a pure insertion). Adjacent records with
+// the same nonzero group are undone and redone together.
+typedef struct {
+  size_t index;
+  size_t span;
+  Pieces pieces;
+  size_t group;
+} PieceRange;
 
 typedef struct {
   PieceRange **elems;
@@ -40,28 +167,160 @@ typedef struct {
   size_t capacity;
 } RangeStack;
 
+// Counters of what a table has done, kept when piecetable.c is built with
+// PT_TRACE
 typedef struct {
+  size_t inserts;
+  size_t deletes;
+  size_t replaces;
+  size_t undos;
+  size_t redos;
+  size_t coalesced_inserts;  // inserts that extended the last piece
+  size_t coalesced_deletes;  // deletes that extended the last undo record
+  size_t coalesced_replaces; // replaces that extended the last undo record
+  size_t seeks;
+  size_t hint_seeks;         // seeks that started from the hint
+  size_t pieces_walked;      // pieces stepped over by seeks within a leaf
+  size_t piece_splits;
+  size_t piece_joins;
+  size_t undo_depth;         // records in the undo stack, kept without PT_TRACE
+  size_t redo_depth;         // records in the redo stack, kept without PT_TRACE
+} PtStats;
+
+// Ring of the last PT_TRACE_EVENTS events of a table, kept when
+// piecetable.c is built with PT_TRACE
+#define PT_TRACE_EVENTS 1024
+
+typedef enum { TraceInsert, TraceDelete, TraceReplace, TraceUndo, TraceRedo, TraceApplyEdits, TraceCompact } TraceKind;
+
+typedef struct {
+  TraceKind kind;
+  size_t index;
+  size_t length;
+} TraceEvent;
+
+typedef struct {
+  TraceEvent events[PT_TRACE_EVENTS];
+  size_t head; // number of events recorded, the next one goes at head % PT_TRACE_EVENTS
+} TraceRing;
+
+// A PieceTable holds all of its state, so separate tables can be used from
+// separate threads in parallel. A single table must only be used by one
+// thread at a time, and that includes reads since they move the hint.
+// Snapshots are read-only tables that can be read from another thread
+// while the table they were taken from is edited.
+typedef struct PIECE_TABLE {
   Buffer original;
   Buffer add;
-  Piece *head;
-  Piece *tail;
-  RangeStack undo_stack; // TODO: init and free
-  RangeStack redo_stack; // TODO: init and free
+  PieceNode *root;
+  PieceCursor hint; // last cursor used, edits and reads tend to stay close to it
+  bool hint_valid;
+  bool seek_hint;   // start seeks from hint when it is in the right leaf
+  RangeStack undo_stack;
+  RangeStack redo_stack;
+  size_t history_bytes;   // memory held by the records of both stacks
+  size_t undo_limit;      // records to keep in the undo stack, 0 for no limit
+  size_t undo_byte_limit; // history_bytes to keep, 0 for no limit
+  size_t undo_dropped;    // records dropped to stay within the limits
+  Slab leaves;  // PieceLeaf nodes
+  Slab inners;  // PieceInner nodes
+  Slab ranges;  // PieceRange records
+  size_t groups; // last group given to a batch of records
   Action last_action;
+  size_t prev_end_index; // end of the last insert or replace, for extending it
+  size_t prev_index;     // index of the last delete, for extending it
   size_t sequence_length;
+  size_t compact_index; // where the next ptCompact carries on from
+  struct PIECE_TABLE *source;   // table this is a snapshot of, NULL for a live table
+  struct PIECE_TABLE *retired;  // released snapshots whose nodes are not reclaimed yet
+  struct PIECE_TABLE *next;     // next snapshot in the retired list
+  size_t snapshots;             // snapshots taken and not reclaimed yet
+  char *session;                // mapped session file the add buffer was loaded from
+  size_t session_length;
+  PtStats stats;
+  TraceRing *trace;
 } PieceTable;
 
+// Contiguous run of text in one of the buffers
+typedef struct {
+  const char *chars;
+  size_t length;
+} Span;
+
+// Returned by searches that find nothing
+#define PT_NOT_FOUND ((size_t) -1)
+
+// Position in the sequence for reading it a span at a time
+typedef struct {
+  PieceTable *pt;
+  PieceCursor cur; // piece containing offset
+  size_t offset;
+} PieceIterator;
+
+// One edit of a batch: delete_length chars at offset are replaced by the
+// length chars at chars
+typedef struct {
+  size_t offset;
+  size_t delete_length;
+  const char *chars;
+  size_t length;
+} PtEdit;
+
+// Memory held by the undo history
+typedef struct {
+  size_t undo_records;
+  size_t redo_records;
+  size_t pieces;     // pieces kept by the records
+  size_t text_bytes; // add buffer text those pieces refer to
+  size_t bytes;      // everything the records hold, including text_bytes
+  size_t dropped;    // records dropped to stay within the budget
+} PtUndoStats;
+
+// How much ptCompact does in one call
+typedef struct {
+  size_t budget;       // pieces to visit before returning, 0 for a whole pass
+  size_t small_length; // runs of pieces shorter than this are rewritten as one
+  bool collect;        // free add buffer segments at the end of a pass
+} PtCompactPolicy;
+
 
 PieceTable *ptCreate(const char *original_buffer, size_t buffer_length);
+PieceTable *ptCreateFromFile(const char *path);
 void ptFree(PieceTable *pt);
+bool ptSaveSession(PieceTable *pt, const char *path, const char *original_path);
+PieceTable *ptLoadSession(const char *path);
+PieceTable *ptSnapshot(PieceTable *pt);
+void ptRelease(PieceTable *snapshot);
 bool ptUndo(PieceTable *pt);
 bool ptRedo(PieceTable *pt);
+void ptSetUndoBudget(PieceTable *pt, size_t records, size_t bytes);
+PtUndoStats ptUndoStats(PieceTable *pt);
 void ptInsertChars(PieceTable *pt, size_t index, const char *chars, size_t length);
 void ptInsertChar(PieceTable *pt, size_t index, char c);
 void ptDeleteChars(PieceTable *pt, size_t index, size_t length);
 void ptDeleteChar(PieceTable *pt, size_t index);
 void ptReplaceChars(PieceTable *pt, size_t index, const char *chars, size_t length);
 void ptReplaceChar(PieceTable *pt, size_t index, char c);
+void ptApplyEdits(PieceTable *pt, const PtEdit *edits, size_t n);
+bool ptCompact(PieceTable *pt, PtCompactPolicy policy);
 size_t ptGetChars(PieceTable *pt, char *dest, size_t index, size_t length);
+PieceIterator ptIterBegin(PieceTable *pt, size_t offset);
+bool ptIterNext(PieceIterator *it, Span *span);
+bool ptIterPrev(PieceIterator *it, Span *span);
+size_t ptLineCount(PieceTable *pt);
+size_t ptLineToOffset(PieceTable *pt, size_t line);
+size_t ptOffsetToLine(PieceTable *pt, size_t offset);
+size_t ptCodepointCount(PieceTable *pt);
+size_t ptOffsetToCodepoint(PieceTable *pt, size_t offset);
+size_t ptCodepointToOffset(PieceTable *pt, size_t codepoint);
+size_t ptOffsetToColumn(PieceTable *pt, size_t offset);
+size_t ptColumnToOffset(PieceTable *pt, size_t line, size_t column);
+size_t ptSearchForward(PieceTable *pt, size_t offset, const char *chars, size_t length);
+size_t ptSearchBackward(PieceTable *pt, size_t offset, const char *chars, size_t length);
+bool ptSearchAll(PieceTable *pt, const char *chars, size_t length, unsigned threads,
+                 const bool *cancel, Offsets *matches);
+PtStats ptGetStats(PieceTable *pt);
+void ptDumpTrace(PieceTable *pt, FILE *fp);
+bool ptWriteToFd(PieceTable *pt, int fd);
+bool ptWriteToFile(PieceTable *pt, const char *path, bool sync);
 void ptPrint(PieceTable *pt);
-
@@ -1,7 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include "piecetable.h"
+#include "history.h"
+#include "newline.h"
+#include "utf8.h"
 
 int main(void) {
   const char text[] = "Hello world";
@@ -182,6 +187,712 @@ int main(void) {
   ptGetChars(pt, dest, 0, pt->sequence_length);
   assert(memcmp(dest, "Hello", pt->sequence_length) == 0);
 
+  const char lines_text[] = "one\ntwo\nthree";
+  ptFree(pt);
+  pt = ptCreate(lines_text, sizeof(lines_text)-1);
+  assert(ptLineCount(pt) == 3);
+  assert(ptLineToOffset(pt, 1) == 4);
+  assert(ptLineToOffset(pt, 2) == 8);
+  assert(ptOffsetToLine(pt, 3) == 0);
+  assert(ptOffsetToLine(pt, 4) == 1);
+
+  ptInsertChars(pt, 5, "\n\n", 2);
+  assert(ptLineCount(pt) == 5);
+  assert(ptLineToOffset(pt, 2) == 6);
+  assert(ptLineToOffset(pt, 4) == 10);
+  assert(ptOffsetToLine(pt, 14) == 4);
+
+  ptDeleteChars(pt, 3, 4);
+  assert(ptLineCount(pt) == 2);
+  assert(ptLineToOffset(pt, 1) == 6);
+
+  ptUndo(pt);
+  assert(ptLineCount(pt) == 5);
+  ptUndo(pt);
+  assert(ptLineCount(pt) == 3);
+  assert(ptLineToOffset(pt, 2) == 8);
+  ptRedo(pt);
+  assert(ptLineToOffset(pt, 4) == 10);
+
+  // random edits spread out so the pieces split across many tree nodes
+  char text2[] = "The quick brown fox jumps over the lazy dog";
+  size_t text2_length = sizeof(text2) - 1;
+  ptFree(pt);
+  pt = ptCreate(text2, text2_length);
+  char expected[8192];
+  char actual[8192];
+  size_t expected_length = text2_length;
+  memcpy(expected, text2, text2_length);
+  srand(1);
+  for (int i = 0; i < 3000; i++) {
+    size_t index = rand() % (expected_length + 1);
+    if (rand() % 4 == 0 && index < expected_length) {
+      size_t length = 1 + rand() % 2;
+      if (index + length > expected_length) length = expected_length - index;
+      ptDeleteChars(pt, index, length);
+      memmove(&expected[index], &expected[index + length], expected_length - index - length);
+      expected_length -= length;
+    } else {
+      char c = rand() % 8 == 0 ? '\n' : 'a' + rand() % 26;
+      ptInsertChar(pt, index, c);
+      memmove(&expected[index + 1], &expected[index], expected_length - index);
+      expected[index] = c;
+      expected_length++;
+    }
+    assert(pt->sequence_length == expected_length);
+    ptGetChars(pt, actual, 0, pt->sequence_length);
+    assert(memcmp(actual, expected, expected_length) == 0);
+  }
+  assert(!pt->root->leaf);
+
+  // the line index agrees with the newlines in the text
+  size_t line = 0;
+  assert(ptLineToOffset(pt, 0) == 0);
+  for (size_t offset = 0; offset < expected_length; offset++) {
+    assert(ptOffsetToLine(pt, offset) == line);
+    if (expected[offset] == '\n') {
+      line++;
+      assert(ptLineToOffset(pt, line) == offset + 1);
+    }
+  }
+  assert(ptOffsetToLine(pt, expected_length) == line);
+  assert(ptLineCount(pt) == line + 1);
+
+  // undoing everything gives back the original text
+  while (ptUndo(pt));
+  assert(pt->sequence_length == text2_length);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, text2, text2_length) == 0);
+  assert(pt->root->leaf && pt->root->count == 1);
+  assert(ptLineCount(pt) == 1);
+
+  // and redoing everything gives back the edited text
+  while (ptRedo(pt));
+  assert(pt->sequence_length == expected_length);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, expected, expected_length) == 0);
+
+  assert(ptLineCount(pt) == line + 1);
+
+  // reads in the middle of the sequence span several pieces
+  ptGetChars(pt, actual, 100, 500);
+  assert(memcmp(actual, &expected[100], 500) == 0);
+
+  // iterating forwards and backwards visits every char once
+  PieceIterator it = ptIterBegin(pt, 0);
+  Span span;
+  size_t offset = 0;
+  while (ptIterNext(&it, &span)) {
+    assert(span.length > 0);
+    assert(memcmp(span.chars, &expected[offset], span.length) == 0);
+    offset += span.length;
+  }
+  assert(offset == expected_length && it.offset == expected_length);
+  while (ptIterPrev(&it, &span)) {
+    assert(span.length > 0);
+    offset -= span.length;
+    assert(memcmp(span.chars, &expected[offset], span.length) == 0);
+  }
+  assert(offset == 0 && it.offset == 0);
+
+  // and can start in the middle of a piece and change direction
+  it = ptIterBegin(pt, 321);
+  assert(ptIterPrev(&it, &span));
+  assert(memcmp(span.chars, &expected[321 - span.length], span.length) == 0);
+  size_t piece_start = it.offset;
+  assert(ptIterNext(&it, &span));
+  assert(it.offset >= 321 && it.offset == piece_start + span.length);
+  assert(memcmp(span.chars, &expected[piece_start], span.length) == 0);
+
+  // snapshots keep reading the text they were taken of while it is edited
+  PieceTable *snapshot = ptSnapshot(pt);
+  while (ptUndo(pt));
+  PieceTable *snapshot2 = ptSnapshot(pt);
+  for (int i = 0; i < 1000; i++) {
+    ptInsertChar(pt, rand() % (pt->sequence_length + 1), i % 16 == 0 ? '\n' : 'x');
+  }
+  assert(pt->sequence_length == text2_length + 1000);
+  assert(snapshot->sequence_length == expected_length);
+  ptGetChars(snapshot, actual, 0, snapshot->sequence_length);
+  assert(memcmp(actual, expected, expected_length) == 0);
+  assert(ptLineCount(snapshot) == line + 1);
+  assert(ptOffsetToLine(snapshot, expected_length) == line);
+  ptGetChars(snapshot2, actual, 0, snapshot2->sequence_length);
+  assert(memcmp(actual, text2, text2_length) == 0);
+  ptRelease(snapshot);
+  ptRelease(snapshot2);
+  while (ptUndo(pt));
+  assert(pt->snapshots == 0);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, text2, text2_length) == 0);
+
+  ptFree(pt);
+
+  // replacing overwrites chars in place as one undo event
+  pt = ptCreate(text, sizeof(text)-1);
+  ptReplaceChars(pt, 6, "there", 5);
+  assert(pt->sequence_length == 11);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "Hello there", pt->sequence_length) == 0);
+  assert(pt->undo_stack.size == 1);
+  ptUndo(pt);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "Hello world", pt->sequence_length) == 0);
+  ptRedo(pt);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "Hello there", pt->sequence_length) == 0);
+
+  // consecutive replaces are grouped like consecutive inserts
+  ptReplaceChar(pt, 0, 'J');
+  ptReplaceChar(pt, 1, 'E');
+  ptReplaceChar(pt, 2, 'L');
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "JELlo there", pt->sequence_length) == 0);
+  assert(pt->undo_stack.size == 2);
+  ptUndo(pt);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "Hello there", pt->sequence_length) == 0);
+  ptRedo(pt);
+
+  // replacing past the end appends the rest
+  ptReplaceChars(pt, 9, "rapy", 4);
+  assert(pt->sequence_length == 13);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "JELlo therapy", pt->sequence_length) == 0);
+  ptUndo(pt);
+  assert(pt->sequence_length == 11);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "JELlo there", pt->sequence_length) == 0);
+  ptFree(pt);
+
+  // batches of edits are applied in order of offset and undone together
+  pt = ptCreate(text, sizeof(text)-1);
+  ptInsertChars(pt, 5, ",", 1);
+  PtEdit edits[] = {
+    { .offset = 12, .delete_length = 0, .chars = "!", .length = 1 },
+    { .offset = 0, .delete_length = 5, .chars = "Goodbye", .length = 7 },
+    { .offset = 7, .delete_length = 5, .chars = "moon", .length = 4 },
+    { .offset = 12, .delete_length = 0, .chars = "!", .length = 1 },
+    { .offset = 6, .delete_length = 0, .chars = " cruel", .length = 6 },
+  };
+  ptApplyEdits(pt, edits, sizeof(edits) / sizeof(*edits));
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(pt->sequence_length == 21);
+  assert(memcmp(dest, "Goodbye, cruel moon!!", pt->sequence_length) == 0);
+  ptUndo(pt);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(pt->sequence_length == 12);
+  assert(memcmp(dest, "Hello, world", pt->sequence_length) == 0);
+  assert(pt->undo_stack.size == 1);
+  ptRedo(pt);
+  assert(pt->redo_stack.size == 0);
+  ptGetChars(pt, dest, 0, pt->sequence_length);
+  assert(memcmp(dest, "Goodbye, cruel moon!!", pt->sequence_length) == 0);
+  ptFree(pt);
+
+  // files are mapped in as the original buffer
+  const char file_name[] = "test_file.txt";
+  FILE *fp = fopen(file_name, "w");
+  fputs("first line\nsecond line\n", fp);
+  fclose(fp);
+  pt = ptCreateFromFile(file_name);
+  assert(pt != NULL && pt->original.segments.elems[0].kind == Mapped);
+  assert(pt->sequence_length == 23);
+  assert(ptLineCount(pt) == 3);
+  assert(ptLineToOffset(pt, 1) == 11);
+  ptInsertChars(pt, 11, "inserted\n", 9);
+  ptGetChars(pt, dest, 0, 20);
+  assert(memcmp(dest, "first line\ninserted\n", 20) == 0);
+
+  // sessions reopen the table with its undo history
+  const char session_name[] = "test_file.session";
+  ptDeleteChars(pt, 0, 6);
+  ptInsertChars(pt, 0, "1st ", 4);
+  ptUndo(pt);
+  assert(ptSaveSession(pt, session_name, file_name));
+  PieceTable *loaded = ptLoadSession(session_name);
+  assert(loaded != NULL && loaded->sequence_length == pt->sequence_length);
+  ptGetChars(loaded, dest, 0, loaded->sequence_length);
+  assert(memcmp(dest, "line\ninserted\nsecond line\n", 26) == 0);
+  assert(ptLineCount(loaded) == 4 && ptLineToOffset(loaded, 2) == 14);
+  assert(ptCodepointCount(loaded) == 26 && ptOffsetToCodepoint(loaded, 14) == 14);
+  assert(loaded->original.samples.size == pt->original.samples.size &&
+         loaded->add.total.codepoints == pt->add.total.codepoints);
+  ptRedo(loaded);
+  ptInsertChars(loaded, 3, "!", 1);
+  ptGetChars(loaded, dest, 0, 10);
+  assert(memcmp(dest, "1st! line\n", 10) == 0);
+  while (ptUndo(loaded));
+  ptGetChars(loaded, dest, 0, loaded->sequence_length);
+  assert(memcmp(dest, "first line\nsecond line\n", 23) == 0);
+  ptFree(loaded);
+  ptFree(pt);
+
+  // files are replaced whole with the text of a table
+  loaded = ptLoadSession(session_name);
+  assert(ptWriteToFile(loaded, file_name, true));
+  ptFree(loaded);
+  fp = fopen(file_name, "r");
+  assert(fread(dest, 1, sizeof(dest), fp) == 26);
+  assert(memcmp(dest, "line\ninserted\nsecond line\n", 26) == 0);
+  fclose(fp);
+
+  // but sessions do not load once the original file has changed
+  assert(ptLoadSession(session_name) == NULL);
+  remove(session_name);
+  remove(file_name);
+  assert(ptCreateFromFile(file_name) == NULL);
+
+  // typing fills add buffer segments without moving text already in them
+  pt = ptCreate(text, sizeof(text)-1);
+  for (int i = 0; i < PT_SEGMENT_CAPACITY + 10; i++) {
+    ptInsertChar(pt, pt->sequence_length, 'a' + i % 26);
+  }
+  assert(pt->add.segments.size == 2);
+  assert(pt->sequence_length == 11 + PT_SEGMENT_CAPACITY + 10);
+  ptGetChars(pt, dest, PT_SEGMENT_CAPACITY + 5, 10);
+  for (int i = 0; i < 10; i++) assert(dest[i] == 'a' + (PT_SEGMENT_CAPACITY - 6 + i) % 26);
+
+  // and very large pastes are spilled to a temporary file
+  char *paste = malloc(PT_SPILL_LENGTH);
+  memset(paste, 'x', PT_SPILL_LENGTH);
+  paste[PT_SPILL_LENGTH - 1] = '\n';
+  size_t line_count = ptLineCount(pt);
+  ptInsertChars(pt, 11, paste, PT_SPILL_LENGTH);
+  free(paste);
+  assert(pt->add.segments.elems[pt->add.segments.size - 1].kind == Mapped);
+  assert(ptLineCount(pt) == line_count + 1);
+  ptGetChars(pt, dest, 9, 4);
+  assert(memcmp(dest, "ldxx", 4) == 0);
+  ptGetChars(pt, dest, 11 + PT_SPILL_LENGTH - 2, 4);
+  assert(memcmp(dest, "x\nab", 4) == 0);
+  ptFree(pt);
+
+  char chunk[1000];
+  memset(chunk, 'y', sizeof(chunk));
+
+  // the undo history is kept within its budget by dropping the oldest steps
+  pt = ptCreate(text2, text2_length);
+  ptSetUndoBudget(pt, 100, 0);
+  for (int i = 0; i < 1000; i++) ptInsertChar(pt, 0, 'a' + i % 26);
+  PtUndoStats stats = ptUndoStats(pt);
+  assert(stats.undo_records <= 100 && stats.undo_records > 80);
+  assert(stats.undo_records + stats.dropped == 1000);
+  while (ptUndo(pt));
+  assert(pt->sequence_length == text2_length + stats.dropped);
+  ptGetChars(pt, actual, 0, 3);
+  assert(actual[0] == 'a' + (stats.dropped - 1) % 26);
+  ptFree(pt);
+
+  // including the text kept by deletes
+  pt = ptCreate(text2, text2_length);
+  ptSetUndoBudget(pt, 0, 10000);
+  for (int i = 0; i < 20; i++) ptInsertChars(pt, 0, chunk, sizeof(chunk));
+  for (int i = 0; i < 20; i++) {
+    ptDeleteChars(pt, 0, sizeof(chunk));
+    ptInsertChar(pt, 0, 'z');
+  }
+  stats = ptUndoStats(pt);
+  assert(stats.bytes <= 10000 && stats.dropped > 0);
+  assert(stats.text_bytes < stats.bytes && stats.text_bytes % sizeof(chunk) == 0);
+  ptUndo(pt);
+  ptUndo(pt);
+  stats = ptUndoStats(pt);
+  assert(stats.redo_records == 2 && stats.text_bytes % sizeof(chunk) == 1);
+  ptFree(pt);
+
+  // and by the redo records, even when there is nothing left to undo
+  pt = ptCreate(text2, text2_length);
+  ptInsertChars(pt, 0, chunk, sizeof(chunk));
+  ptUndo(pt);
+  ptSetUndoBudget(pt, 0, 10);
+  stats = ptUndoStats(pt);
+  assert(stats.undo_records == 0 && stats.redo_records == 0 && stats.bytes <= 10);
+  assert(!ptRedo(pt) && pt->sequence_length == text2_length);
+  ptFree(pt);
+
+  // compaction merges and rewrites pieces without changing the text
+  pt = ptCreate(text2, text2_length);
+  expected_length = text2_length;
+  memcpy(expected, text2, text2_length);
+  for (int i = 0; i < 2000; i++) {
+    size_t index = rand() % (expected_length + 1);
+    char c = i % 32 == 0 ? '\n' : 'a' + rand() % 26;
+    ptInsertChar(pt, index, c);
+    memmove(&expected[index + 1], &expected[index], expected_length - index);
+    expected[index] = c;
+    expected_length++;
+  }
+  size_t pieces = 0;
+  it = ptIterBegin(pt, 0);
+  while (ptIterNext(&it, &span)) pieces++;
+  PtCompactPolicy policy = { .budget = 50, .small_length = 16, .collect = true };
+  int calls = 1;
+  while (!ptCompact(pt, policy)) calls++;
+  assert(calls > 1);
+  size_t compacted = 0;
+  it = ptIterBegin(pt, 0);
+  while (ptIterNext(&it, &span)) compacted++;
+  assert(compacted < pieces / 8);
+  assert(pt->sequence_length == expected_length);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, expected, expected_length) == 0);
+  assert(ptOffsetToLine(pt, expected_length) == ptLineCount(pt) - 1);
+  while (ptUndo(pt));
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, text2, text2_length) == 0);
+  while (ptRedo(pt));
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, expected, expected_length) == 0);
+  ptFree(pt);
+
+  // and frees add buffer segments that only undone edits referred to
+  pt = ptCreate(text2, text2_length);
+  ptInsertChars(pt, 0, "kept\n", 5);
+  for (int i = 0; i < 200; i++) {
+    ptInsertChars(pt, rand() % (pt->sequence_length + 1), chunk, sizeof(chunk));
+  }
+  assert(pt->add.segments.size == 4);
+  while (ptUndo(pt));
+  ptRedo(pt);
+  ptInsertChar(pt, 5, '!');
+  assert(ptCompact(pt, (PtCompactPolicy) { .collect = true }));
+  for (size_t i = 0; i + 1 < pt->add.segments.size; i++) {
+    assert(pt->add.segments.elems[i].elems == NULL);
+  }
+  assert(pt->add.newlines.size == 1);
+  assert(ptLineToOffset(pt, 1) == 5);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, "kept\n!The", 9) == 0);
+  ptUndo(pt);
+  ptUndo(pt);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, text2, text2_length) == 0);
+  ptFree(pt);
+
+  // edits are counted and traced
+  pt = ptCreate(text, sizeof(text)-1);
+  ptInsertChars(pt, 5, ",", 1);
+  ptInsertChars(pt, 6, " big", 4);
+  ptDeleteChar(pt, 9);
+  ptDeleteChar(pt, 8);
+  ptUndo(pt);
+  PtStats pt_stats = ptGetStats(pt);
+  assert(pt_stats.inserts == 2 && pt_stats.coalesced_inserts == 1);
+  assert(pt_stats.deletes == 2 && pt_stats.coalesced_deletes == 1);
+  assert(pt_stats.undos == 1 && pt_stats.undo_depth == 1 && pt_stats.redo_depth == 1);
+  assert(pt_stats.piece_splits > 0 && pt_stats.seeks > 0);
+  fp = tmpfile();
+  ptDumpTrace(pt, fp);
+  rewind(fp);
+  char trace[200];
+  while (fgets(trace, sizeof(trace), fp) && strncmp(trace, "4 ", 2) != 0);
+  assert(strcmp(trace, "4 undo index=2 length=0\n") == 0);
+  fclose(fp);
+  ptFree(pt);
+
+  // searches find matches across pieces in both directions
+  pt = ptCreate(text, sizeof(text)-1);
+  for (size_t i = 0; i < 60; i++) {
+    ptInsertChar(pt, (i * 7) % (pt->sequence_length + 1), "ab"[i % 3 == 0]);
+  }
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  const char *needles[] = { "a", "ab", "aab", "baab", "Hello", "zz", "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb" };
+  for (size_t n = 0; n < sizeof(needles) / sizeof(*needles); n++) {
+    size_t needle_length = strlen(needles[n]);
+    for (size_t offset = 0; offset <= pt->sequence_length; offset++) {
+      size_t expected = PT_NOT_FOUND;
+      for (size_t i = offset; expected == PT_NOT_FOUND && i + needle_length <= pt->sequence_length; i++) {
+        if (memcmp(&actual[i], needles[n], needle_length) == 0) expected = i;
+      }
+      assert(ptSearchForward(pt, offset, needles[n], needle_length) == expected);
+      expected = PT_NOT_FOUND;
+      for (size_t i = offset; expected == PT_NOT_FOUND && i >= needle_length; i--) {
+        if (memcmp(&actual[i - needle_length], needles[n], needle_length) == 0) expected = i - needle_length;
+      }
+      assert(ptSearchBackward(pt, offset, needles[n], needle_length) == expected);
+    }
+  }
+  assert(ptSearchForward(pt, 3, "", 0) == 3);
+
+  // parallel searches of a snapshot find every match in order
+  PieceTable *search_snapshot = ptSnapshot(pt);
+  ptInsertChars(pt, 0, "ab", 2);
+  for (size_t n = 0; n < sizeof(needles) / sizeof(*needles); n++) {
+    size_t needle_length = strlen(needles[n]);
+    Offsets expected = {0};
+    for (size_t i = 0; i + needle_length <= search_snapshot->sequence_length; i++) {
+      if (memcmp(&actual[i], needles[n], needle_length) == 0) listAppend(&expected, i);
+    }
+    for (unsigned threads = 1; threads <= 5; threads++) {
+      Offsets matches = {0};
+      assert(ptSearchAll(search_snapshot, needles[n], needle_length, threads, NULL, &matches));
+      assert(matches.size == expected.size);
+      assert(matches.size == 0 || memcmp(matches.elems, expected.elems, matches.size * sizeof(size_t)) == 0);
+      free(matches.elems);
+    }
+    free(expected.elems);
+  }
+  bool cancel = true;
+  Offsets matches = {0};
+  assert(!ptSearchAll(search_snapshot, "a", 1, 2, &cancel, &matches) && matches.size == 0);
+  ptRelease(search_snapshot);
+  ptFree(pt);
+
+  // codepoints and columns are found across pieces, and edits keep chars whole
+  const char utf8_text[] = "h\xc3\xa9llo\n\xe4\xb8\x96\xe7\x95\x8c e\xcc\x81!";
+  pt = ptCreate(utf8_text, sizeof(utf8_text)-1);
+  ptInsertChars(pt, 3, "\xf0\x9f\x98\x80", 4);
+  // h, e acute, an emoji, l, l, o, newline, two wide chars, space, e, a
+  // combining acute and ! make 13 codepoints
+  assert(ptCodepointCount(pt) == 13);
+  assert(ptOffsetToCodepoint(pt, 7) == 3 && ptCodepointToOffset(pt, 3) == 7);
+  assert(ptCodepointToOffset(pt, 13) == pt->sequence_length);
+  assert(ptOffsetToColumn(pt, 7) == 4 && ptOffsetToColumn(pt, 17) == 4);
+  assert(ptColumnToOffset(pt, 0, 2) == 3 && ptColumnToOffset(pt, 0, 3) == 3);
+  assert(ptColumnToOffset(pt, 1, 2) == 14 && ptColumnToOffset(pt, 1, 6) == 21);
+  assert(ptColumnToOffset(pt, 0, 100) == 10 && ptColumnToOffset(pt, 1, 100) == 22);
+  ptInsertChar(pt, 5, 'x');
+  ptDeleteChar(pt, 2);
+  ptGetChars(pt, actual, 0, pt->sequence_length);
+  assert(memcmp(actual, "hx\xf0\x9f\x98\x80llo\n", 10) == 0 && ptCodepointCount(pt) == 13);
+  assert(utf8Count(utf8_text, sizeof(utf8_text)-1) == utf8CountScalar(utf8_text, sizeof(utf8_text)-1));
+  assert(utf8Width(utf8_text, sizeof(utf8_text)-1, 0) == 13);
+  ptFree(pt);
+
+  // the kernels are only run on CPUs that have them, like the dispatchers do
+#ifdef NL_X86
+  bool avx2 = __builtin_cpu_supports("avx2");
+  if (!avx2) printf("skipping the AVX2 kernels, the CPU does not support AVX2\n");
+#endif
+
+  // the newline scanners agree with each other, across vector boundaries
+  char scan[300];
+  for (size_t i = 0; i < sizeof(scan); i++) scan[i] = i % 7 == 0 || i % 31 == 0 ? '\n' : 'x';
+  size_t scan_offsets[sizeof(scan)], scan_expected[sizeof(scan)], scanned;
+  for (size_t start = 0; start < 40; start++) {
+    size_t length = sizeof(scan) - start;
+    size_t n = nlLocateScalar(&scan[start], length, 5, scan_expected, sizeof(scan), &scanned);
+    assert(scanned == length && n == nlCountScalar(&scan[start], length));
+    assert(nlCount(&scan[start], length) == n);
+    assert(nlLocate(&scan[start], length, 5, scan_offsets, sizeof(scan), &scanned) == n && scanned == length);
+    assert(memcmp(scan_offsets, scan_expected, n * sizeof(size_t)) == 0);
+    // stopping at max leaves scanned at the first newline not located
+    assert(nlLocate(&scan[start], length, 5, scan_offsets, 10, &scanned) == 10);
+    assert(scan_offsets[9] == scan_expected[9] && scanned == scan_expected[10] - 5);
+#ifdef NL_X86
+    assert(nlCountSse2(&scan[start], length) == n);
+    assert(nlLocateSse2(&scan[start], length, 5, scan_offsets, 10, &scanned) == 10 && scanned == scan_expected[10] - 5);
+    if (avx2) {
+      assert(nlCountAvx2(&scan[start], length) == n);
+      assert(nlLocateAvx2(&scan[start], length, 5, scan_offsets, sizeof(scan), &scanned) == n);
+      assert(memcmp(scan_offsets, scan_expected, n * sizeof(size_t)) == 0);
+    }
+#endif
+  }
+
+  // and so do the UTF-8 counters
+  for (size_t i = 0; i < sizeof(scan); i++) scan[i] = i % 37 == 0 ? '\xc3' : i % 37 == 1 ? '\xa9' : 'x';
+  for (size_t start = 0; start < 40; start++) {
+    size_t length = sizeof(scan) - start;
+    size_t count = utf8CountScalar(&scan[start], length), ascii = utf8AsciiScalar(&scan[start], length);
+    assert(utf8Count(&scan[start], length) == count && utf8Ascii(&scan[start], length) == ascii);
+#ifdef UTF8_X86
+    assert(utf8CountSse2(&scan[start], length) == count && utf8AsciiSse2(&scan[start], length) == ascii);
+    if (avx2) assert(utf8CountAvx2(&scan[start], length) == count && utf8AsciiAvx2(&scan[start], length) == ascii);
+#endif
+  }
+
+  // gap buffers insert and delete at the gap wherever it is moved
+  GapBuffer *gb = gbCreate();
+  gbInsertChars(gb, "held", 4);
+  gbPushChars(gb, " line", 5);
+  gbMoveGap(gb, 0);
+  gbInsertChar(gb, 'a');
+  gbMoveGap(gb, 5);
+  assert(gbDeleteChar(gb) == 'd');
+  gbInsertChars(gb, "ld!", 3);
+  assert(gbLen(gb) == 12 && gbGetChar(gb, 0) == 'a' && gbGetChar(gb, 11) == 'e');
+  char *gb_chars = gbGetChars(gb);
+  assert(strcmp(gb_chars, "ahelld! line") == 0);
+  free(gb_chars);
+  assert(gbPopChar(gb) == 'e');
+  gbFree(gb);
+
+  // short lines stay inline up to GB_INLINE_CAPACITY chars and move to the
+  // heap with the next one, keeping their chars and gap
+  char inline_chars[GB_INLINE_CAPACITY + 1];
+  for (int i = 0; i <= GB_INLINE_CAPACITY; i++) inline_chars[i] = 'a' + i % 26;
+  gb = gbCreate();
+  gbPushChars(gb, inline_chars, GB_INLINE_CAPACITY / 2);
+  gbInsertChars(gb, &inline_chars[GB_INLINE_CAPACITY / 2], GB_INLINE_CAPACITY - GB_INLINE_CAPACITY / 2);
+  assert(gbLen(gb) == GB_INLINE_CAPACITY && gb->elems == (char *) (gb + 1));
+  gbMoveGap(gb, 10);
+  gbInsertChar(gb, '!');
+  assert(gbLen(gb) == GB_INLINE_CAPACITY + 1 && gb->elems != (char *) (gb + 1));
+  assert(gbGetChar(gb, 9) == inline_chars[45] && gbGetChar(gb, 10) == '!' && gbGetChar(gb, 11) == inline_chars[46]);
+  // and move back once they are short enough again
+  gbDeleteChar(gb);
+  gbShrink(gb);
+  assert(gb->elems == (char *) (gb + 1));
+  gb_chars = gbGetChars(gb);
+  assert(memcmp(gb_chars, &inline_chars[36], 36) == 0 && memcmp(&gb_chars[36], inline_chars, 36) == 0);
+  free(gb_chars);
+  gbFree(gb);
+
+  // lines are sliced from a block of text, with a last line without a
+  // newline counted too and one empty line for empty text
+  char block[] = "first\n\nthird";
+  size_t block_count;
+  GapBuffer *block_lines = gbSliceLines(block, sizeof(block) - 1, &block_count);
+  assert(block_count == 3 && gbLen(&block_lines[1]) == 0 && gbLen(&block_lines[2]) == 5);
+  assert(block_lines[0].borrowed && block_lines[0].elems == block && block_lines[2].elems == &block[7]);
+  free(block_lines);
+  block_lines = gbSliceLines(block, 7, &block_count);
+  assert(block_count == 2 && gbLen(&block_lines[0]) == 5 && gbLen(&block_lines[1]) == 0);
+  free(block_lines);
+  block_lines = gbSliceLines(block, 6, &block_count);
+  assert(block_count == 1 && gbLen(&block_lines[0]) == 5);
+  free(block_lines);
+  block_lines = gbSliceLines(block, 0, &block_count);
+  assert(block_count == 1 && gbLen(&block_lines[0]) == 0);
+  free(block_lines);
+
+  // they read the block until they are first written to, which copies them
+  block_lines = gbSliceLines(block, sizeof(block) - 1, &block_count);
+  gbMoveGap(&block_lines[0], 2);
+  assert(block_lines[0].borrowed && gbGetChar(&block_lines[0], 2) == 'r');
+  gbInsertChar(&block_lines[0], '-');
+  assert(!block_lines[0].borrowed && block_lines[0].elems != block);
+  gbMoveGap(&block_lines[2], 5);
+  gbDeleteChar(&block_lines[2]);
+  gbPushChar(&block_lines[2], '!');
+  assert(strcmp(block, "first\n\nthird") == 0);
+  gb_chars = gbGetChars(&block_lines[0]);
+  assert(strcmp(gb_chars, "fi-rst") == 0);
+  free(gb_chars);
+  gb_chars = gbGetChars(&block_lines[2]);
+  assert(strcmp(gb_chars, "thir!") == 0);
+  free(gb_chars);
+  for (size_t i = 0; i < block_count; i++) gbFreeChars(&block_lines[i]);
+  free(block_lines);
+
+  // writing lines gives back the text they were sliced from, over more
+  // lines than one writev call takes and with gaps inside some of them
+  size_t slice_length = 0;
+  char *slice_text = malloc(3000 * 12);
+  for (int i = 0; i < 3000; i++) slice_length += sprintf(&slice_text[slice_length], "%*d\n", i % 11, i);
+  size_t slice_count;
+  GapBuffer *slices = gbSliceLines(slice_text, slice_length, &slice_count);
+  GapBuffer *slice_ptrs[3000];
+  assert(slice_count == 3000);
+  for (size_t i = 0; i < slice_count; i++) {
+    slice_ptrs[i] = &slices[i];
+    if (i % 100 == 0) {
+      gbMoveGap(&slices[i], gbLen(&slices[i]) / 2);
+      gbInsertChar(&slices[i], 'x');
+      gbDeleteChar(&slices[i]);
+    }
+  }
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd != -1 && gbWriteLines(slice_ptrs, slice_count, fd));
+  close(fd);
+  char *written = malloc(slice_length + 1);
+  fp = fopen(file_name, "r");
+  assert(fread(written, 1, slice_length + 1, fp) == slice_length);
+  assert(memcmp(written, slice_text, slice_length) == 0);
+  fclose(fp);
+  remove(file_name);
+  for (size_t i = 0; i < slice_count; i++) gbFreeChars(&slices[i]);
+  free(slices);
+  free(written);
+  free(slice_text);
+
+  // the editor history undoes a run of typed chars as one step
+  char history_text[] = "one\ntwo\n";
+  Lines lines = {0};
+  lines.file = gbSliceLines(history_text, sizeof(history_text) - 1, &lines.fileCount);
+  for (size_t i = 0; i < lines.fileCount; i++) listAppend(&lines, &lines.file[i]);
+  History history = {0};
+  history.group++;
+  for (int i = 0; i < 3; i++) {
+    recordChange(&history, 0, lines.elems[0], 3 + i, 3 + i, &"!?."[i], 1);
+    gbPushChar(lines.elems[0], "!?."[i]);
+  }
+  assert(history.commands.size == 1);
+  Command *cmd = historyUndo(&history, &lines);
+  assert(cmd != NULL && cmd->line == 0 && cmd->col == 3);
+  assert(gbLen(lines.elems[0]) == 3 && historyUndo(&history, &lines) == NULL);
+  assert(historyRedo(&history, &lines) == cmd && gbLen(lines.elems[0]) == 6);
+
+  // and a group that splits a line and types into it as one step too
+  history.group++;
+  GapBuffer *split = lines.elems[0];
+  recordChange(&history, 0, split, 3, 6, NULL, 0);
+  gbMoveGap(split, 3);
+  gb = gbCreate();
+  gbSplit(gb, split);
+  recordCreate(&history, 1, gb);
+  listInsert(&lines, gb, 1);
+  recordChange(&history, 1, gb, 0, 0, "x", 1);
+  gbMoveGap(gb, 0);
+  gbInsertChar(gb, 'x');
+  assert(lines.size == 3 && gbLen(lines.elems[0]) == 3 && gbLen(lines.elems[1]) == 4);
+  cmd = historyUndo(&history, &lines);
+  assert(cmd != NULL && cmd->type == LineChange && cmd->line == 0);
+  gb_chars = gbGetChars(lines.elems[0]);
+  assert(lines.size == 2 && strcmp(gb_chars, "one!?.") == 0);
+  free(gb_chars);
+  assert(historyRedo(&history, &lines) != NULL && lines.size == 3);
+  gb_chars = gbGetChars(lines.elems[1]);
+  assert(strcmp(gb_chars, "x!?.") == 0 && gbLen(lines.elems[0]) == 3 && gbLen(lines.elems[2]) == 3);
+  free(gb_chars);
+
+  // a new edit drops the steps that could be redone
+  historyUndo(&history, &lines);
+  history.group++;
+  recordDestroy(&history, 1, lines.elems[1]);
+  linesRemove(&lines, 1);
+  assert(lines.size == 1 && history.pos == history.commands.size);
+  assert(historyRedo(&history, &lines) == NULL);
+  assert(historyUndo(&history, &lines) != NULL && lines.size == 2 && gbLen(lines.elems[1]) == 3);
+
+  // the oldest steps are dropped to keep the history under its limit
+  int big_length = HISTORY_BYTE_LIMIT / 4;
+  char *big = malloc(big_length);
+  memset(big, 'b', big_length);
+  for (int i = 0; i < 8; i++) {
+    history.group++;
+    recordChange(&history, 1, lines.elems[1], 0, 0, big, big_length);
+    gbMoveGap(lines.elems[1], 0);
+    gbInsertChars(lines.elems[1], big, big_length);
+  }
+  assert(history.bytes <= HISTORY_BYTE_LIMIT);
+  int undone = 0;
+  while (historyUndo(&history, &lines)) undone++;
+  assert(undone > 0 && undone < 8 && gbLen(lines.elems[1]) == 3 + (size_t) (8 - undone) * big_length);
+  // including when a run of typing grows past it
+  while (historyRedo(&history, &lines));
+  history.group++;
+  int typed = gbLen(lines.elems[0]);
+  for (int i = 0; i < 5; i++) {
+    recordChange(&history, 0, lines.elems[0], typed, typed, big, big_length);
+    gbPushChars(lines.elems[0], big, big_length);
+    typed += big_length;
+  }
+  assert(history.commands.size == 1 && historyUndo(&history, &lines) != NULL);
+  assert(gbLen(lines.elems[0]) == typed - 5 * big_length);
+  free(big);
+  historyClear(&history);
+  assert(history.bytes == 0);
+  for (size_t i = 0; i < lines.size; i++) {
+    if (!linesIsFile(&lines, lines.elems[i])) gbFree(lines.elems[i]);
+  }
+  for (size_t i = 0; i < lines.fileCount; i++) gbFreeChars(&lines.file[i]);
+  free(lines.file);
+  free(lines.elems);
+  free(history.commands.elems);
+
   printf("PASSED ALL TESTS\n");
   return 0;
 }
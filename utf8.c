@@ -0,0 +1,201 @@
+#include "utf8.h"
+
+#ifdef UTF8_X86
+#include <immintrin.h>
+#endif
+
+// Codepoints that take no columns or two columns in a terminal. This
+// covers combining marks, zero-width format chars and the East Asian wide
+// blocks and emoji, not every entry of the Unicode tables.
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+  unsigned width;
+} WidthRange;
+
+const WidthRange width_ranges[] = {
+  { 0x0300, 0x036F, 0 }, { 0x0483, 0x0489, 0 }, { 0x0591, 0x05BD, 0 },
+  { 0x0610, 0x061A, 0 }, { 0x064B, 0x065F, 0 }, { 0x0E31, 0x0E31, 0 },
+  { 0x0E34, 0x0E3A, 0 }, { 0x0E47, 0x0E4E, 0 }, { 0x1100, 0x115F, 2 },
+  { 0x1AB0, 0x1AFF, 0 }, { 0x1DC0, 0x1DFF, 0 }, { 0x200B, 0x200F, 0 },
+  { 0x202A, 0x202E, 0 }, { 0x2060, 0x2064, 0 }, { 0x20D0, 0x20FF, 0 },
+  { 0x231A, 0x231B, 2 }, { 0x2329, 0x232A, 2 }, { 0x23E9, 0x23EC, 2 },
+  { 0x25FD, 0x25FE, 2 }, { 0x2614, 0x2615, 2 }, { 0x2E80, 0x303E, 2 },
+  { 0x3041, 0x33FF, 2 }, { 0x3400, 0x4DBF, 2 }, { 0x4E00, 0x9FFF, 2 },
+  { 0xA000, 0xA4CF, 2 }, { 0xA960, 0xA97F, 2 }, { 0xAC00, 0xD7A3, 2 },
+  { 0xF900, 0xFAFF, 2 }, { 0xFE00, 0xFE0F, 0 }, { 0xFE10, 0xFE19, 2 },
+  { 0xFE20, 0xFE2F, 0 }, { 0xFE30, 0xFE6F, 2 }, { 0xFEFF, 0xFEFF, 0 },
+  { 0xFF00, 0xFF60, 2 }, { 0xFFE0, 0xFFE6, 2 }, { 0x1F300, 0x1F64F, 2 },
+  { 0x1F680, 0x1F6FF, 2 }, { 0x1F900, 0x1F9FF, 2 }, { 0x1FA70, 0x1FAFF, 2 },
+  { 0x20000, 0x2FFFD, 2 }, { 0x30000, 0x3FFFD, 2 }, { 0xE0000, 0xE0FFF, 0 },
+};
+
+/* Returns the length of the sequence that starts with lead, which is 1 for
+ * ASCII and for bytes that cannot start a sequence. */
+size_t utf8Length(unsigned char lead) {
+  if (lead >= 0xC0 && lead < 0xE0) return 2;
+  if (lead >= 0xE0 && lead < 0xF0) return 3;
+  if (lead >= 0xF0 && lead < 0xF8) return 4;
+  return 1;
+}
+
+/* Returns the codepoint of a complete sequence of length chars. */
+uint32_t utf8Decode(const char *chars, size_t length) {
+  const unsigned char *s = (const unsigned char *) chars;
+  uint32_t codepoint = length == 1 ? s[0] : s[0] & (0x7F >> length);
+  for (size_t i = 1; i < length; i++) codepoint = codepoint << 6 | (s[i] & 0x3F);
+  return codepoint;
+}
+
+/* Returns the columns codepoint takes in a terminal. ASCII control chars
+ * take one like any other char. */
+unsigned utf8CodepointWidth(uint32_t codepoint) {
+  if (codepoint < width_ranges[0].first) return 1;
+  size_t lo = 0, hi = sizeof(width_ranges) / sizeof(*width_ranges);
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (codepoint < width_ranges[mid].first) {
+      hi = mid;
+    } else if (codepoint > width_ranges[mid].last) {
+      lo = mid + 1;
+    } else {
+      return width_ranges[mid].width;
+    }
+  }
+  return 1;
+}
+
+/* Returns the length of the char at the start of length chars, which is 1
+ * for a byte that is not part of a complete sequence, and sets width to
+ * its columns. */
+size_t utf8Next(const char *chars, size_t length, unsigned *width) {
+  const unsigned char *s = (const unsigned char *) chars;
+  size_t n = utf8Length(s[0]);
+  *width = s[0] < 0x80;
+  if (n == 1) return 1;
+  for (size_t i = 1; i < n; i++) {
+    if (i >= length || (s[i] & 0xC0) != 0x80) return 1;
+  }
+  *width = utf8CodepointWidth(utf8Decode(chars, n));
+  return n;
+}
+
+/* Returns the columns taken by the chars that end in length chars. Up to
+ * 3 chars before chars are looked at, if there are that many before. */
+size_t utf8Width(const char *chars, size_t length, size_t before) {
+  const unsigned char *s = (const unsigned char *) chars;
+  size_t width = 0, i = 0;
+  while (i < length) {
+    size_t ascii = utf8Ascii(&chars[i], length - i);
+    width += ascii;
+    i += ascii;
+    if (i == length) break;
+    if ((s[i] & 0xC0) == 0x80) {
+      // a continuation byte ends a char if the lead before it says so
+      const unsigned char *c = &s[i];
+      size_t k = 1;
+      while (k <= 3 && k <= i + before && (*(c - k) & 0xC0) == 0x80) k++;
+      if (k <= 3 && k <= i + before && utf8Length(*(c - k)) == k + 1) {
+        width += utf8CodepointWidth(utf8Decode((const char *) (c - k), k + 1));
+      }
+    }
+    i++;
+  }
+  return width;
+}
+
+/* Returns the number of codepoints in length chars, which is the number of
+ * chars that are not continuation bytes. */
+size_t utf8CountScalar(const char *chars, size_t length) {
+  size_t count = 0;
+  for (size_t i = 0; i < length; i++) count += ((unsigned char) chars[i] & 0xC0) != 0x80;
+  return count;
+}
+
+/* Returns the number of ASCII chars at the start of length chars. */
+size_t utf8AsciiScalar(const char *chars, size_t length) {
+  size_t i = 0;
+  while (i < length && (unsigned char) chars[i] < 0x80) i++;
+  return i;
+}
+
+#ifdef UTF8_X86
+
+// Continuation bytes are the signed chars below -64, so one signed compare
+// finds the chars that start a codepoint, and the sign bits of a block are
+// the chars that are not ASCII.
+
+__attribute__((target("sse2")))
+size_t utf8CountSse2(const char *chars, size_t length) {
+  const __m128i continuation = _mm_set1_epi8(-65);
+  size_t count = 0, i = 0;
+  while (i + 16 <= length) {
+    __m128i counters = _mm_setzero_si128();
+    for (int n = 0; n < 255 && i + 16 <= length; n++, i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *) &chars[i]);
+      counters = _mm_sub_epi8(counters, _mm_cmpgt_epi8(block, continuation));
+    }
+    __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+    count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+  }
+  return count + utf8CountScalar(&chars[i], length - i);
+}
+
+__attribute__((target("sse2")))
+size_t utf8AsciiSse2(const char *chars, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) &chars[i]));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return i + utf8AsciiScalar(&chars[i], length - i);
+}
+
+__attribute__((target("avx2")))
+size_t utf8CountAvx2(const char *chars, size_t length) {
+  const __m256i continuation = _mm256_set1_epi8(-65);
+  size_t count = 0, i = 0;
+  while (i + 32 <= length) {
+    __m256i counters = _mm256_setzero_si256();
+    for (int n = 0; n < 255 && i + 32 <= length; n++, i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *) &chars[i]);
+      counters = _mm256_sub_epi8(counters, _mm256_cmpgt_epi8(block, continuation));
+    }
+    __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + utf8CountScalar(&chars[i], length - i);
+}
+
+__attribute__((target("avx2")))
+size_t utf8AsciiAvx2(const char *chars, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) &chars[i]));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+  return i + utf8AsciiScalar(&chars[i], length - i);
+}
+
+#endif
+
+/* Returns the number of codepoints in length chars with the fastest
+ * version the CPU supports. */
+size_t utf8Count(const char *chars, size_t length) {
+#ifdef UTF8_X86
+  if (__builtin_cpu_supports("avx2")) return utf8CountAvx2(chars, length);
+  if (__builtin_cpu_supports("sse2")) return utf8CountSse2(chars, length);
+#endif
+  return utf8CountScalar(chars, length);
+}
+
+/* Returns the number of ASCII chars at the start of length chars with the
+ * fastest version the CPU supports. */
+size_t utf8Ascii(const char *chars, size_t length) {
+#ifdef UTF8_X86
+  if (__builtin_cpu_supports("avx2")) return utf8AsciiAvx2(chars, length);
+  if (__builtin_cpu_supports("sse2")) return utf8AsciiSse2(chars, length);
+#endif
+  return utf8AsciiScalar(chars, length);
+}
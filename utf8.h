@@ -0,0 +1,27 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Counting the codepoints and display width of UTF-8 text. Codepoints are
+// counted at their first byte and widths at their last byte, so counting
+// the chars before an offset never depends on the chars after it. Invalid
+// and incomplete sequences take no columns. The SSE2 and AVX2 versions
+// are picked at run time on x86-64, with a scalar one elsewhere.
+
+size_t utf8Length(unsigned char lead);
+uint32_t utf8Decode(const char *chars, size_t length);
+unsigned utf8CodepointWidth(uint32_t codepoint);
+size_t utf8Next(const char *chars, size_t length, unsigned *width);
+size_t utf8Width(const char *chars, size_t length, size_t before);
+
+size_t utf8Count(const char *chars, size_t length);
+size_t utf8Ascii(const char *chars, size_t length);
+
+size_t utf8CountScalar(const char *chars, size_t length);
+size_t utf8AsciiScalar(const char *chars, size_t length);
+#ifdef __x86_64__
+#define UTF8_X86 1
+size_t utf8CountSse2(const char *chars, size_t length);
+size_t utf8AsciiSse2(const char *chars, size_t length);
+size_t utf8CountAvx2(const char *chars, size_t length);
+size_t utf8AsciiAvx2(const char *chars, size_t length);
+#endif